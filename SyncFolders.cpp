@@ -4,320 +4,7015 @@
 #include <chrono>
 #include <thread>
 #include <vector>
+#include <algorithm>
+#include <array>
+#include <charconv>
 #include <exception>
 #include <iomanip>
 #include <sstream>
 #include <csignal>
 #include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <cstdint>
+#include <system_error>
+#include <list>
+#include <map>
+#include <unordered_map>
+#include <optional>
+#include <cstring>
+#include <cctype>
+#include <ctime>
+#include <limits>
+#include <type_traits>
 #include <openssl/sha.h>
+#include <openssl/evp.h>
+
+#ifdef __linux__
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/resource.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <zlib.h>
+#endif
 
 namespace fs = std::filesystem;
 
 std::mutex logMutex;  ///< Mutex to protect log file operations
 std::atomic<bool> keepRunning(true);  // Atomic flag to control the running state of the program
-std::atomic<bool> changesMade(false);  // Atomic flag to track changes during synchronization
+thread_local std::vector<std::string>* capturedLog = nullptr;  ///< When set, log entries of the current thread are held here
+std::atomic<bool> syncRequested(false);  ///< SIGUSR1 asked for a cycle to start now
+std::atomic<bool> statsRequested(false);  ///< SIGUSR2 asked for the statistics to be logged
+std::atomic<int> wakeFd(-1);  ///< Write end of the self-pipe the signal handler wakes the SignalDispatcher through
+static_assert(std::atomic<int>::is_always_lock_free, "the signal handler may only use lock-free atomics");
+class AsyncLogger;
+/// Background writer of the main log file, while one is running; every thread that logs through it
+/// must be joined before it is destroyed, since a producer may still hold the pointer it loaded
+std::atomic<AsyncLogger*> asyncLogger(nullptr);
 
 /**
- * brief Signal handler for SIGINT and SIGTERM to gracefully stop the synchronization
+ * brief Signal handler: SIGINT and SIGTERM stop the synchronization, SIGUSR1 requests a cycle, SIGUSR2 statistics
+ *
+ * Only sets flags and writes to the self-pipe, which is all a signal handler may safely do.
  * param signal Signal number
  */
 void signalHandler(int signal) {
     if (signal == SIGINT || signal == SIGTERM) {
         keepRunning = false;
     }
+#ifdef SIGUSR1
+    else if (signal == SIGUSR1) {
+        syncRequested = true;
+    }
+    else if (signal == SIGUSR2) {
+        statsRequested = true;
+    }
+#endif
+#ifdef __linux__
+    int savedErrno = errno;
+    char byte = 0;
+    int fd = wakeFd.load();
+    if (fd >= 0) {
+        (void)!write(fd, &byte, 1);
+    }
+    errno = savedErrno;
+#endif
 }
 
 /**
- * brief Get current time as a string in "YYYY-MM-DD HH:MM:SS" format
- * return Current time as a string
+ * brief Formats log timestamps, reusing the text of the current second across threads
+ *
+ * The formatted "YYYY-MM-DD HH:MM:SS" of the last second seen is kept behind a sequence lock
+ * made of atomics: readers copy it and retry nothing, falling back to formatting themselves
+ * if a writer was busy, and the thread that first sees a new second formats it once and
+ * publishes it unless another thread is already doing so. Neither side ever blocks.
+ * Milliseconds, when enabled, are appended to the cached text arithmetically.
  */
-std::string getCurrentTime() {
-    auto now = std::chrono::system_clock::now();
-    auto now_c = std::chrono::system_clock::to_time_t(now);
-    std::tm now_tm;
-    localtime_s(&now_tm, &now_c);  // Use localtime_s for safety
+class TimestampCache {
+public:
+    /**
+     * brief Append milliseconds to every timestamp
+     */
+    void setMilliseconds(bool enabled) {
+        milliseconds = enabled;
+    }
 
-    std::ostringstream oss;
-    oss << std::put_time(&now_tm, "%Y-%m-%d %H:%M:%S");
-    return oss.str();
-}
+    /**
+     * brief Format a point in time in local time
+     * param time Time to format
+     * return "YYYY-MM-DD HH:MM:SS", followed by ".mmm" if milliseconds are enabled
+     */
+    std::string format(std::chrono::system_clock::time_point time) {
+        auto sinceEpoch = time.time_since_epoch();
+        auto second = std::chrono::duration_cast<std::chrono::seconds>(sinceEpoch);
+        if (second > sinceEpoch) {
+            second -= std::chrono::seconds(1);  // Round towards the past for times before the epoch
+        }
+        char text[sizeof(words)];
+        if (!read(second.count(), text)) {
+            formatSecond(second.count(), text);
+            publish(second.count(), text);
+        }
+
+        std::string result(text, secondsLength);
+        if (milliseconds) {
+            auto millis = std::chrono::duration_cast<std::chrono::milliseconds>(sinceEpoch - second).count();
+            char fraction[] = { '.', static_cast<char>('0' + millis / 100), static_cast<char>('0' + millis / 10 % 10),
+                static_cast<char>('0' + millis % 10) };
+            result.append(fraction, sizeof(fraction));
+        }
+        return result;
+    }
+
+private:
+    static constexpr size_t secondsLength = 19;  ///< "YYYY-MM-DD HH:MM:SS"
+
+    static void formatSecond(std::int64_t second, char* text) {
+        std::time_t now_c = static_cast<std::time_t>(second);
+        std::tm now_tm;
+#ifdef _WIN32
+        localtime_s(&now_tm, &now_c);  // Use localtime_s for safety
+#else
+        localtime_r(&now_c, &now_tm);
+#endif
+        char buffer[32];
+        std::strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S", &now_tm);
+        std::memcpy(text, buffer, secondsLength);
+    }
+
+    bool read(std::int64_t wanted, char* text) const {
+        std::uint64_t before = sequence.load(std::memory_order_acquire);
+        if (before & 1) {
+            return false;
+        }
+        std::int64_t cached = second.load(std::memory_order_relaxed);
+        std::uint64_t copy[std::size(words)];
+        for (size_t i = 0; i < std::size(words); ++i) {
+            copy[i] = words[i].load(std::memory_order_relaxed);
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (cached != wanted || sequence.load(std::memory_order_relaxed) != before) {
+            return false;
+        }
+        std::memcpy(text, copy, sizeof(copy));
+        return true;
+    }
+
+    void publish(std::int64_t formatted, const char* text) {
+        std::uint64_t current = sequence.load(std::memory_order_relaxed);
+        if (formatted <= second.load(std::memory_order_relaxed)) {
+            return;  // Never go back to an older second
+        }
+        if ((current & 1) || !sequence.compare_exchange_strong(current, current + 1, std::memory_order_relaxed)) {
+            return;  // Someone else is publishing
+        }
+        std::atomic_thread_fence(std::memory_order_release);
+        std::uint64_t copy[std::size(words)];
+        std::memcpy(copy, text, sizeof(copy));
+        second.store(formatted, std::memory_order_relaxed);
+        for (size_t i = 0; i < std::size(words); ++i) {
+            words[i].store(copy[i], std::memory_order_relaxed);
+        }
+        sequence.store(current + 2, std::memory_order_release);
+    }
+
+    std::atomic<std::uint64_t> sequence{ 0 };  ///< Odd while the cache is being rewritten
+    std::atomic<std::int64_t> second{ std::numeric_limits<std::int64_t>::min() };
+    std::atomic<std::uint64_t> words[3];       ///< The formatted second, 19 of 24 bytes used
+    std::atomic<bool> milliseconds{ false };
+};
+
+TimestampCache timestampCache;  ///< Formats the timestamps of all log entries
 
 /**
- * brief Log operations to both log file and console
- * param logFilePath Path to the log file
- * param message Message to log
+ * brief When and how a log file is rotated
  */
-void logOperation(const std::string& logFilePath, const std::string& message) {
-    std::lock_guard<std::mutex> guard(logMutex);
-    std::string logEntry = "[" + getCurrentTime() + "] " + message;
-    std::ofstream logFile(logFilePath, std::ios_base::app);
-    if (!logFile.is_open()) {
-        std::cerr << "Error: Unable to open log file: " << logFilePath << std::endl;
-        return;
+struct LogRotation {
+    std::uintmax_t maxSize = 0;        ///< Rotate once the file reaches this many bytes (0: no size limit)
+    std::chrono::minutes maxAge{ 0 };  ///< Rotate once the file has been written to for this long (0: no age limit)
+    unsigned generations = 5;          ///< Rotated files kept next to the log file
+    bool compress = true;              ///< Compress rotated files with gzip (Linux only)
+
+    bool enabled() const {
+        return maxSize > 0 || maxAge.count() > 0;
     }
-    logFile << logEntry << std::endl;
-    std::cout << logEntry << std::endl;
-}
+};
 
 /**
- * brief Compute SHA-256 hash of a file
- * param path Path to the file
- * return SHA-256 hash as a string
+ * brief Give the calling thread idle CPU and I/O priority, so that its housekeeping never
+ * competes with the synchronization
  */
-std::string computeFileHash(const fs::path& path) {
-    std::ifstream file(path, std::ios::binary);
-    std::vector<char> buffer(std::istreambuf_iterator<char>(file), {});
-    unsigned char hash[SHA256_DIGEST_LENGTH];
-    SHA256((unsigned char*)&buffer[0], buffer.size(), hash);
-    std::ostringstream hashStream;
-    for (int i = 0; i < SHA256_DIGEST_LENGTH; ++i) {
-        hashStream << std::hex << std::setw(2) << std::setfill('0') << (int)hash[i];
-    }
-    return hashStream.str();
+void lowerThreadPriority() {
+#ifdef __linux__
+    // Both apply to the calling thread only
+    setpriority(PRIO_PROCESS, 0, 19);
+    syscall(SYS_ioprio_set, 1 /* IOPRIO_WHO_PROCESS */, 0, 3 << 13 /* IOPRIO_CLASS_IDLE */);
+#endif
 }
 
 /**
- * brief Synchronize files from source to replica
- * param source Source directory path
- * param replica Replica directory path
- * param logFilePath Path to the log file
+ * brief Compresses and prunes the rotated generations of a log file on a background thread
+ *
+ * A rotated file is renamed to <log>.<YYYYmmdd-HHMMSS> next to the log by its writer, which
+ * then only has to wake the archiver. The archiver compresses every uncompressed generation
+ * to <generation>.gz at idle priority and deletes all but the newest generations. Files left
+ * uncompressed by a shutdown are picked up when the next run starts.
  */
-void syncCopy(const fs::path& source, const fs::path& replica, const std::string& logFilePath) {
-    try {
-        for (const auto& entry : fs::recursive_directory_iterator(source)) {
-            const auto& path = entry.path();
-            auto relativePath = fs::relative(path, source);
-            auto replicaPath = replica / relativePath;
+class LogArchiver {
+public:
+    /**
+     * brief Create an archiver; nothing is compressed until start()
+     * param logFilePath Path to the log file
+     * param rotation Generations to keep and whether to compress them
+     */
+    LogArchiver(const std::string& logFilePath, const LogRotation& rotation)
+        : logFile(fs::absolute(fs::path(logFilePath))), rotation(rotation) {}
+
+    ~LogArchiver() {
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        if (archiver.joinable()) {
+            archiver.join();
+        }
+    }
+
+    LogArchiver(const LogArchiver&) = delete;
+    LogArchiver& operator=(const LogArchiver&) = delete;
+
+    /**
+     * brief Start the thread, which first archives what a previous run left behind
+     */
+    void start() {
+        pending = true;
+        archiver = std::thread(&LogArchiver::archive, this);
+    }
 
-            if (fs::is_regular_file(path)) {
-                bool shouldCopy = false;
-                if (!fs::exists(replicaPath)) {
-                    shouldCopy = true;
+    /**
+     * brief Name for the next rotated generation: the local time, made unique if a generation already used it
+     */
+    fs::path nextGeneration() const {
+        std::time_t now = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+        std::tm local{};
+#ifdef _WIN32
+        localtime_s(&local, &now);
+#else
+        localtime_r(&now, &local);
+#endif
+        std::ostringstream stamp;
+        stamp << std::put_time(&local, "%Y%m%d-%H%M%S");
+        std::string base = logFile.filename().string() + "." + stamp.str();
+        std::string unique = base;
+        std::error_code error;
+        for (int n = 2; fs::exists(logFile.parent_path() / unique, error) || fs::exists(logFile.parent_path() / (unique + ".gz"), error); ++n) {
+            unique = base + "-" + std::to_string(n);
+        }
+        return logFile.parent_path() / unique;
+    }
+
+    /**
+     * brief Tell the archiver that a generation was rotated
+     */
+    void rotated() {
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            pending = true;
+        }
+        wake.notify_all();
+    }
+
+private:
+    /**
+     * brief A rotated file of this log
+     */
+    struct Generation {
+        fs::path path;
+        std::string stamp;  ///< YYYYmmdd-HHMMSS
+        int sequence = 1;   ///< Suffix making the stamp unique, 1 if there is none
+        bool compressed = false;
+        bool partial = false;  ///< Leftover of an interrupted compression
+    };
+
+    /**
+     * brief Recognize a rotated generation of the log by its file name
+     */
+    bool parseGeneration(const fs::path& path, Generation& generation) const {
+        std::string name = path.filename().string();
+        std::string prefix = logFile.filename().string() + ".";
+        if (name.compare(0, prefix.size(), prefix) != 0) {
+            return false;
+        }
+        std::string rest = name.substr(prefix.size());
+        auto strip = [&rest](const std::string& suffix) {
+            if (rest.size() > suffix.size() && rest.compare(rest.size() - suffix.size(), suffix.size(), suffix) == 0) {
+                rest.resize(rest.size() - suffix.size());
+                return true;
+            }
+            return false;
+        };
+        generation.partial = strip(".tmp");
+        generation.compressed = strip(".gz");
+        if (generation.partial && !generation.compressed) {
+            return false;
+        }
+        if (rest.size() < 15 || rest[8] != '-' || !std::all_of(rest.begin(), rest.begin() + 15, [](char c) { return c == '-' || std::isdigit(static_cast<unsigned char>(c)); })) {
+            return false;
+        }
+        generation.path = path;
+        generation.stamp = rest.substr(0, 15);
+        generation.sequence = 1;
+        if (rest.size() > 15) {
+            // A suffix too long for an int is some other file, not a generation
+            const char* first = rest.data() + 16;
+            const char* last = rest.data() + rest.size();
+            auto [end, error] = std::from_chars(first, last, generation.sequence);
+            if (rest[15] != '-' || first == last || end != last || error != std::errc() || generation.sequence < 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * brief gzip a generation next to itself and remove the original
+     * return False if it could not be compressed; the original is then kept
+     */
+    bool compress(const fs::path& path) {
+#ifdef __linux__
+        fs::path target = path;
+        target += ".gz";
+        fs::path temporary = target;
+        temporary += ".tmp";
+        std::ifstream in(path, std::ios::binary);
+        gzFile out = gzopen(temporary.c_str(), "wb6");
+        if (!in.is_open() || out == nullptr) {
+            if (out != nullptr) {
+                gzclose(out);
+            }
+            return false;
+        }
+        std::vector<char> buffer(256 * 1024);
+        bool good = true;
+        while (good && !stopping && in) {
+            in.read(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+            auto read = static_cast<unsigned>(in.gcount());
+            good = read == 0 || gzwrite(out, buffer.data(), read) == static_cast<int>(read);
+        }
+        good = gzclose(out) == Z_OK && good && !stopping && in.eof();
+        std::error_code error;
+        if (good) {
+            fs::rename(temporary, target, error);
+        }
+        if (!good || error) {
+            fs::remove(temporary, error);
+            return false;
+        }
+        fs::remove(path, error);
+        return true;
+#else
+        (void)path;
+        return false;
+#endif
+    }
+
+    /**
+     * brief Background thread: compress and prune generations whenever one is rotated
+     */
+    void archive() {
+        lowerThreadPriority();
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!stopping) {
+            wake.wait(lock, [this] { return stopping || pending; });
+            if (stopping) {
+                break;
+            }
+            pending = false;
+            lock.unlock();
+
+            std::vector<Generation> generations;
+            std::error_code error;
+            fs::path directory = logFile.parent_path();
+            for (fs::directory_iterator it(directory, error), end; !error && it != end; it.increment(error)) {
+                Generation generation;
+                if (parseGeneration(it->path(), generation)) {
+                    generations.push_back(std::move(generation));
                 }
-                else {
-                    std::string sourceHash = computeFileHash(path);
-                    std::string replicaHash = computeFileHash(replicaPath);
-                    if (sourceHash != replicaHash) {
-                        shouldCopy = true;
-                    }
+            }
+            for (auto& generation : generations) {
+                if (generation.partial) {
+                    fs::remove(generation.path, error);
                 }
+                else if (!generation.compressed && rotation.compress && compress(generation.path)) {
+                    generation.path += ".gz";
+                    generation.compressed = true;
+                }
+            }
+            generations.erase(std::remove_if(generations.begin(), generations.end(), [](const Generation& generation) { return generation.partial; }),
+                generations.end());
 
-                if (shouldCopy) {
-                    fs::copy_file(path, replicaPath, fs::copy_options::overwrite_existing);
-                    logOperation(logFilePath, "Copied file: " + path.string() + " to " + replicaPath.string());
-                    changesMade = true;
+            // Newest first; everything past the retained generations goes
+            std::sort(generations.begin(), generations.end(), [](const Generation& a, const Generation& b) {
+                return a.stamp != b.stamp ? a.stamp > b.stamp : a.sequence > b.sequence;
+            });
+            for (size_t i = rotation.generations; i < generations.size(); ++i) {
+                if (!fs::remove(generations[i].path, error) && error) {
+                    std::cerr << "Error: Unable to remove old log file: " << generations[i].path.string() << std::endl;
                 }
             }
+            lock.lock();
         }
     }
-    catch (const fs::filesystem_error& e) {
-        logOperation(logFilePath, "Filesystem error: " + std::string(e.what()));
-    }
-    catch (const std::exception& e) {
-        logOperation(logFilePath, "Error: " + std::string(e.what()));
-    }
-}
 
+    fs::path logFile;
+    LogRotation rotation;
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool pending = false;  ///< A generation was rotated since the last pass
+    std::atomic<bool> stopping{ false };
+    std::thread archiver;
+};
 
 /**
- * brief Delete files from replica that do not exist in source
- * param source Source directory path
- * param replica Replica directory path
- * param logFilePath Path to the log file
+ * brief Background log writer fed through a lock-free ring buffer
+ *
+ * Producers claim a slot of a bounded multi-producer, single-consumer ring with one
+ * compare-and-swap and publish the entry through the slot's sequence number; nothing on
+ * their path takes a lock or touches the file. A writer thread keeps the log file open,
+ * drains whatever has accumulated and writes it to the file and the console as one batch.
+ * When the ring is full producers wait for the writer instead of dropping entries, and the
+ * destructor drains the ring, so nothing logged before a clean shutdown is lost.
+ * The same writer also serves the event log, which only goes to its file. With rotation
+ * enabled the writer renames the file aside between two entries once it is due, reopens it
+ * and leaves compression and pruning to a LogArchiver.
  */
-void syncDelete(const fs::path& source, const fs::path& replica, const std::string& logFilePath) {
-    try {
-        std::vector<fs::path> filesToRemove;
+class AsyncLogger {
+public:
+    /**
+     * brief Start the writer thread
+     * param logFilePath Path to the log file
+     * param flushInterval Longest time written entries may sit in the stream buffers; zero flushes after every batch
+     * param rotation When to rotate the file and how many generations to keep
+     * param mainLog Route log entries for logFilePath to this writer and echo them to the console
+     */
+    AsyncLogger(const std::string& logFilePath, std::chrono::milliseconds flushInterval, const LogRotation& rotation = {}, bool mainLog = true)
+        : logFilePath(logFilePath), flushInterval(flushInterval), rotation(rotation), mainLog(mainLog), slots(new Slot[capacity]) {
+        for (size_t i = 0; i < capacity; ++i) {
+            slots[i].sequence.store(i, std::memory_order_relaxed);
+        }
+        if (rotation.enabled()) {
+            archiver = std::make_unique<LogArchiver>(logFilePath, rotation);
+            archiver->start();
+        }
+        writer = std::thread(&AsyncLogger::write, this);
+        if (mainLog) {
+            asyncLogger.store(this, std::memory_order_release);
+        }
+    }
+
+    /**
+     * brief Write out every pending entry and stop the writer; later entries are written directly
+     */
+    ~AsyncLogger() {
+        if (mainLog) {
+            asyncLogger.store(nullptr, std::memory_order_release);
+        }
+        stopping = true;
+        wakeWriter();
+        writer.join();
+    }
+
+    AsyncLogger(const AsyncLogger&) = delete;
+    AsyncLogger& operator=(const AsyncLogger&) = delete;
 
-        for (const auto& entry : fs::recursive_directory_iterator(replica)) {
-            const auto& path = entry.path();
-            auto relativePath = fs::relative(path, replica);
-            auto sourcePath = source / relativePath;
+    const std::string& path() const { return logFilePath; }
+
+    /**
+     * brief Number of entries pushed but not written yet, as of the writer's last batch
+     */
+    size_t backlog() const {
+        size_t written = consumed.load(std::memory_order_relaxed);
+        return tail.load(std::memory_order_relaxed) - written;
+    }
 
-            if (!fs::exists(sourcePath)) {
-                filesToRemove.push_back(path);
+    /**
+     * brief Queue an entry; waits only if the ring is full
+     * param time When the entry was logged; the writer formats it. A default time_point marks a preformatted entry
+     * param entry Log message, or a whole timestamped line
+     */
+    void push(std::chrono::system_clock::time_point time, std::string entry) {
+        size_t position = tail.load(std::memory_order_relaxed);
+        Slot* slot;
+        for (;;) {
+            slot = &slots[position & (capacity - 1)];
+            size_t sequence = slot->sequence.load(std::memory_order_acquire);
+            auto distance = static_cast<std::ptrdiff_t>(sequence - position);
+            if (distance == 0) {
+                if (tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            }
+            else if (distance < 0) {
+                // Full: let the writer catch up
+                wakeWriter();
+                std::this_thread::yield();
+                position = tail.load(std::memory_order_relaxed);
             }
+            else {
+                position = tail.load(std::memory_order_relaxed);
+            }
+        }
+        slot->time = time;
+        slot->entry = std::move(entry);
+        slot->sequence.store(position + 1);
+        if (writerIdle.load()) {
+            wakeWriter();
         }
+    }
+
+private:
+    static constexpr size_t capacity = 8192;  ///< Power of two
+    static constexpr size_t maxBatch = 1024;
+    static constexpr std::chrono::seconds rotationRetry{ 60 };  ///< Wait after a failed size rotation without an age limit
+
+    struct Slot {
+        std::atomic<size_t> sequence;  ///< Equals the position when free, position + 1 when filled
+        std::chrono::system_clock::time_point time;
+        std::string entry;
+    };
+
+    /**
+     * brief Whether the oldest entry has been published; writer thread only
+     */
+    bool ready() const {
+        return slots[head & (capacity - 1)].sequence.load() == head + 1;
+    }
 
-        for (const auto& path : filesToRemove) {
-            fs::remove_all(path);
-            logOperation(logFilePath, "Removed: " + path.string());
-            changesMade = true;  // Flag changes
+    /**
+     * brief Take the oldest entry, if it has been published; writer thread only
+     */
+    bool pop(std::chrono::system_clock::time_point& time, std::string& entry) {
+        Slot& slot = slots[head & (capacity - 1)];
+        if (slot.sequence.load(std::memory_order_acquire) != head + 1) {
+            return false;
         }
+        time = slot.time;
+        entry = std::move(slot.entry);
+        slot.sequence.store(head + capacity, std::memory_order_release);
+        ++head;
+        return true;
     }
-    catch (const fs::filesystem_error& e) {
-        logOperation(logFilePath, "Filesystem error: " + std::string(e.what()));
+
+    void wakeWriter() {
+        std::lock_guard<std::mutex> guard(wakeMutex);
+        wake.notify_one();
     }
-    catch (const std::exception& e) {
-        logOperation(logFilePath, "Error: " + std::string(e.what()));
+
+    /**
+     * brief Rename the log file aside as a new generation; writer thread only
+     *
+     * A failed rename is reported once until a later rotation succeeds, and the archiver is
+     * not woken, since there is no new generation to compress or make room for.
+     * return False if the file could not be renamed and stays in place
+     */
+    bool rotate(std::ofstream& logFile) {
+        logFile.close();
+        std::error_code error;
+        fs::rename(logFilePath, archiver->nextGeneration(), error);
+        if (error) {
+            if (!reportedRotateError) {
+                std::cerr << "Error: Unable to rotate log file: " << logFilePath << ": " << error.message() << std::endl;
+                reportedRotateError = true;
+            }
+            return false;
+        }
+        reportedRotateError = false;
+        archiver->rotated();
+        return true;
     }
-}
 
-/**
- * brief Synchronize subdirectories from source to replica
- * param source Source directory path
- * param replica Replica directory path
- * param logFilePath Path to the log file
- */
-void syncSubdirectories(const fs::path& source, const fs::path& replica, const std::string& logFilePath) {
-    try {
-        for (const auto& entry : fs::recursive_directory_iterator(source)) {
-            const auto& path = entry.path();
-            auto relativePath = fs::relative(path, source);
-            auto replicaPath = replica / relativePath;
+    /**
+     * brief Writer thread: drain the ring in batches until stopped and empty
+     */
+    void write() {
+        std::ofstream logFile;
+        std::uintmax_t fileSize = 0;
+        std::chrono::steady_clock::time_point openedAt;
+        std::chrono::steady_clock::time_point retryRotationAt;  ///< No rotation is attempted before this, after a failed one
+        bool reportedOpenError = false;
+        auto lastFlush = std::chrono::steady_clock::now();
+        bool unflushed = false;
+        std::chrono::system_clock::time_point time;
+        std::string entry;
+        std::string prefix;
+        for (;;) {
+            bool done = stopping.load();
+            size_t written = 0;
+            while (written < maxBatch && pop(time, entry)) {
+                prefix.clear();
+                if (time != std::chrono::system_clock::time_point()) {
+                    prefix = "[" + timestampCache.format(time) + "] ";
+                }
+                if (archiver && logFile.is_open() && fileSize > 0
+                    && ((rotation.maxSize > 0 && fileSize + prefix.size() + entry.size() + 1 > rotation.maxSize)
+                        || (rotation.maxAge.count() > 0 && std::chrono::steady_clock::now() - openedAt >= rotation.maxAge))
+                    && std::chrono::steady_clock::now() >= retryRotationAt
+                    && !rotate(logFile)) {
+                    // The file stays oversized, so back off instead of retrying on every entry
+                    retryRotationAt = std::chrono::steady_clock::now()
+                        + (rotation.maxAge.count() > 0 ? std::chrono::steady_clock::duration(rotation.maxAge) : rotationRetry);
+                }
+                if (!logFile.is_open()) {
+                    logFile.clear();
+                    logFile.open(logFilePath, std::ios_base::app);
+                    if (!logFile.is_open() && !reportedOpenError) {
+                        std::cerr << "Error: Unable to open log file: " << logFilePath << std::endl;
+                        reportedOpenError = true;
+                    }
+                    std::error_code error;
+                    fileSize = fs::file_size(logFilePath, error);
+                    if (error) {
+                        fileSize = 0;
+                    }
+                    openedAt = std::chrono::steady_clock::now();
+                }
+                if (logFile.is_open()) {
+                    logFile << prefix << entry << '\n';
+                    fileSize += prefix.size() + entry.size() + 1;
+                }
+                if (mainLog) {
+                    std::cout << prefix << entry << '\n';
+                }
+                ++written;
+            }
+            consumed.store(head, std::memory_order_relaxed);
+            unflushed = unflushed || written > 0;
 
-            if (fs::is_directory(path)) {
-                // Create directory in replica if it does not exist
-                if (!fs::exists(replicaPath)) {
-                    fs::create_directory(replicaPath);
-                    logOperation(logFilePath, "Created directory: " + replicaPath.string());
-                    changesMade = true;  // Flag changes
+            auto now = std::chrono::steady_clock::now();
+            if (unflushed && (flushInterval.count() == 0 || now - lastFlush >= flushInterval || done)) {
+                logFile.flush();
+                if (mainLog) {
+                    std::cout.flush();
+                }
+                lastFlush = now;
+                unflushed = false;
+            }
+            if (written == maxBatch) {
+                continue;
+            }
+            if (done && written == 0) {
+                return;  // Entries pushed before stopping was set have all been written
+            }
+            if (written == 0) {
+                auto timeout = unflushed ? std::min<std::chrono::steady_clock::duration>(flushInterval - (now - lastFlush), std::chrono::milliseconds(100))
+                                         : std::chrono::steady_clock::duration(std::chrono::milliseconds(100));
+                std::unique_lock<std::mutex> lock(wakeMutex);
+                writerIdle = true;
+                // A producer that published before seeing the flag would not wake us
+                if (!ready() && !stopping) {
+                    wake.wait_for(lock, timeout);
                 }
+                writerIdle = false;
             }
         }
     }
-    catch (const fs::filesystem_error& e) {
-        logOperation(logFilePath, "Filesystem error: " + std::string(e.what()));
-    }
-    catch (const std::exception& e) {
-        logOperation(logFilePath, "Error: " + std::string(e.what()));
-    }
-}
+
+    std::string logFilePath;
+    std::chrono::milliseconds flushInterval;
+    LogRotation rotation;
+    bool mainLog;
+    std::unique_ptr<LogArchiver> archiver;  ///< Set when rotation is enabled
+    bool reportedRotateError = false;       ///< A failed rotation was reported; writer thread only
+    std::unique_ptr<Slot[]> slots;
+    std::atomic<size_t> tail{ 0 };  ///< Next position producers claim
+    size_t head = 0;                ///< Next position the writer reads
+    std::atomic<size_t> consumed{ 0 };  ///< head as of the last batch, for backlog()
+    std::atomic<bool> stopping{ false };
+    std::atomic<bool> writerIdle{ false };
+    std::mutex wakeMutex;
+    std::condition_variable wake;
+    std::thread writer;
+};
 
 /**
- * brief Main synchronization function that calls subdirectory, copy, and delete operations
- * param source Source directory path
- * param replica Replica directory path
+ * brief Write an already formatted entry to both log file and console
+ *
+ * Entries for the log file of a running AsyncLogger are queued to it; any other entry is
+ * written directly.
  * param logFilePath Path to the log file
+ * param logEntry Timestamped log line
  */
-void syncFolders(const fs::path& source, const fs::path& replica, const std::string& logFilePath) {
-    changesMade = false;  // Reset changes flag at the beginning of synchronization
-    try {
-        // Ensure replica exists
-        if (!fs::exists(replica)) {
-            fs::create_directory(replica);
-            logOperation(logFilePath, "Created replica directory: " + replica.string());
-            changesMade = true;  // Flag changes
-        }
-
-        // Sync subdirectories
-        syncSubdirectories(source, replica, logFilePath);
-
-        // Sync copy operations
-        syncCopy(source, replica, logFilePath);
-
-        // Sync delete operations
-        syncDelete(source, replica, logFilePath);
-    }
-    catch (const fs::filesystem_error& e) {
-        logOperation(logFilePath, "Filesystem error: " + std::string(e.what()));
+void writeLogEntry(const std::string& logFilePath, std::string logEntry) {
+    AsyncLogger* logger = asyncLogger.load(std::memory_order_acquire);
+    if (logger != nullptr && logger->path() == logFilePath) {
+        logger->push({}, std::move(logEntry));
+        return;
     }
-    catch (const std::exception& e) {
-        logOperation(logFilePath, "Error: " + std::string(e.what()));
+    std::lock_guard<std::mutex> guard(logMutex);
+    std::ofstream logFile(logFilePath, std::ios_base::app);
+    if (!logFile.is_open()) {
+        std::cerr << "Error: Unable to open log file: " << logFilePath << std::endl;
+        return;
     }
+    logFile << logEntry << std::endl;
+    std::cout << logEntry << std::endl;
 }
 
 /**
- * brief Validate if the source path is a valid directory
- * param source Source directory path
+ * brief Log operations to both log file and console
+ *
+ * While the calling thread captures its log (see capturedLog), the entry is held back and
+ * written later by whoever installed the capture.
  * param logFilePath Path to the log file
- * return True if the source path is valid, false otherwise
+ * param message Message to log
  */
-bool isSourceValid(const fs::path& source, const std::string& logFilePath) {
-    if (!fs::exists(source)) {
-        logOperation(logFilePath, "Error: Source path does not exist.");
-        return false;
+void logOperation(const std::string& logFilePath, const std::string& message) {
+    auto now = std::chrono::system_clock::now();
+    AsyncLogger* logger = capturedLog == nullptr ? asyncLogger.load(std::memory_order_acquire) : nullptr;
+    if (logger != nullptr && logger->path() == logFilePath) {
+        // Only the clock is read here; the writer thread formats the timestamp
+        logger->push(now, message);
+        return;
     }
-    if (!fs::is_directory(source)) {
-        logOperation(logFilePath, "Error: Source path is not a directory.");
-        return false;
+    std::string logEntry = "[" + timestampCache.format(now) + "] " + message;
+    if (capturedLog != nullptr) {
+        capturedLog->push_back(std::move(logEntry));
+        return;
     }
-    return true;
+    writeLogEntry(logFilePath, std::move(logEntry));
 }
 
 /**
- * brief Count the total number of files and directories in a given path
- * param directory Directory path
- * return Total count of files and directories
+ * brief Compute SHA-256 hash of a file
+ * param path Path to the file
+ * return SHA-256 hash as a string
  */
-int countFilesAndDirectories(const fs::path& directory) {
-    int count = 0;
-    for (const auto& entry : fs::recursive_directory_iterator(directory)) {
-        if (fs::is_regular_file(entry) || fs::is_directory(entry)) {
-            ++count;
-        }
+std::string computeFileHash(const fs::path& path) {
+    std::ifstream file(path, std::ios::binary);
+    std::vector<char> buffer(std::istreambuf_iterator<char>(file), {});
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+    SHA256((unsigned char*)&buffer[0], buffer.size(), hash);
+    std::ostringstream hashStream;
+    for (int i = 0; i < SHA256_DIGEST_LENGTH; ++i) {
+        hashStream << std::hex << std::setw(2) << std::setfill('0') << (int)hash[i];
     }
-    return count;
+    return hashStream.str();
 }
 
 /**
- * brief Check if the synchronization is complete by comparing the number of files and directories
- * param source Source directory path
- * param replica Replica directory path
- * param logFilePath Path to the log file
+ * brief Kind of a directory entry, as far as synchronization is concerned
  */
-void checkSyncCompletion(const fs::path& source, const fs::path& replica, const std::string& logFilePath) {
-    int sourceCount = countFilesAndDirectories(source);
-    int replicaCount = countFilesAndDirectories(replica);
+enum class EntryKind {
+    File,       ///< Regular file (or symlink to one), mirrored by content
+    Directory,  ///< Directory, mirrored recursively
+    Other       ///< Anything else; left alone on both sides
+};
 
-    if (sourceCount == replicaCount && changesMade) {
-        logOperation(logFilePath, "Synchronization complete. All files and directories are synchronized.");
-        changesMade = false;  // Reset changes flag after logging completion
-    }
-}
+/**
+ * brief One entry of a directory listing
+ */
+struct ListingEntry {
+    fs::path::string_type name;  ///< File name within the listed directory
+    EntryKind kind;              ///< What the entry is
+    bool descend;                ///< False for directory symlinks, which are not followed
+    std::uintmax_t size;         ///< File size if the listing already provided it, else unknownSize
+};
+
+constexpr std::uintmax_t unknownSize = static_cast<std::uintmax_t>(-1);  ///< Size not read yet
 
 /**
- * brief Main function to handle input arguments and initiate synchronization process
- * param argc Argument count
- * param argv Argument values
- * return Exit status
+ * brief Source and replica locations of one directory pair, built incrementally during the walk
+ *
+ * The relative path is carried from parent to child, so the mirrored paths of an entry are
+ * plain string appends and nothing has to be made relative to a root again.
  */
-int main(int argc, char* argv[]) {
-    if (argc != 5) {
-        std::cerr << "Usage: " << argv[0] << " <source_path> <replica_path> <interval_seconds> <log_file_path>" << std::endl;
-        return 1;
-    }
+struct TreePath {
+    fs::path::string_type source;    ///< Source directory
+    fs::path::string_type replica;   ///< Replica directory
+    fs::path::string_type relative;  ///< Path relative to both roots, empty for the roots
 
-    fs::path sourcePath = argv[1];
-    fs::path replicaPath = argv[2];
-    int interval = std::stoi(argv[3]);
-    std::string logFilePath = argv[4];
+    /**
+     * brief Append a name to a directory path
+     * param directory Directory path
+     * param name Entry name
+     * return directory + separator + name
+     */
+    static fs::path::string_type join(const fs::path::string_type& directory, const fs::path::string_type& name) {
+        fs::path::string_type joined;
+        joined.reserve(directory.size() + 1 + name.size());
+        joined = directory;
+        if (!joined.empty() && joined.back() != fs::path::preferred_separator && joined.back() != '/') {
+            joined += fs::path::preferred_separator;
+        }
+        joined += name;
+        return joined;
+    }
 
-    // If the source is invalid, return
-    if (!isSourceValid(sourcePath, logFilePath)) {
-        return 1;
+    /**
+     * brief Paths of a child directory of this pair
+     * param name Name of the child
+     */
+    TreePath child(const fs::path::string_type& name) const {
+        return { join(source, name), join(replica, name), relative.empty() ? name : join(relative, name) };
     }
 
-    logOperation(logFilePath, "Starting folder synchronization.");
-    logOperation(logFilePath, "Source path: " + sourcePath.string());
-    logOperation(logFilePath, "Replica path: " + replicaPath.string());
-    logOperation(logFilePath, "Synchronization interval: " + std::to_string(interval) + " seconds");
+    fs::path::string_type sourceEntry(const fs::path::string_type& name) const { return join(source, name); }
+    fs::path::string_type replicaEntry(const fs::path::string_type& name) const { return join(replica, name); }
+};
 
-    // Set up signal handling for graceful shutdown
-    std::signal(SIGINT, signalHandler);
-    std::signal(SIGTERM, signalHandler);
+/**
+ * brief Gitignore-style include/exclude rules, compiled for matching during the walk
+ *
+ * Rules are evaluated in order and the last one matching an entry decides: a plain pattern
+ * excludes, a pattern starting with '!' includes again. A pattern ending in '/' only matches
+ * directories. A pattern containing another '/' is matched against the path relative to the
+ * roots, otherwise against the entry name at any depth. '*' and '?' do not match '/', '[...]'
+ * is a character class and '**' matches across directories. Excluded directories are never
+ * descended into, so nothing below them can be included again.
+ *
+ * Literal names, "*.suffix" patterns and literal paths, which make up most real rule sets,
+ * are hash table lookups; only the remaining patterns run the glob matcher, and only those
+ * that could still override the best match found so far.
+ */
+class PathFilter {
+public:
+    using String = fs::path::string_type;
 
-    while (keepRunning) {
-        if (!isSourceValid(sourcePath, logFilePath)) {
-            logOperation(logFilePath, "Source directory has been deleted or is inaccessible. Exiting...");
-            return 1;
+    /**
+     * brief Add a rule
+     * param pattern Gitignore-style pattern, optionally starting with '!'
+     * return False if the pattern is empty or malformed
+     */
+    bool add(String pattern) {
+        Rule rule;
+        if (!pattern.empty() && pattern[0] == '!') {
+            rule.include = true;
+            pattern.erase(0, 1);
+        }
+        if (!pattern.empty() && pattern.back() == '/') {
+            rule.directoryOnly = true;
+            pattern.pop_back();
+        }
+        rule.anchored = pattern.find('/') != String::npos;
+        if (!pattern.empty() && pattern[0] == '/') {
+            pattern.erase(0, 1);
+        }
+        if (pattern.empty() || !compile(pattern, rule.tokens)) {
+            return false;
         }
 
-        auto start = std::chrono::steady_clock::now();
-
-        // Sync folders
-        syncFolders(sourcePath, replicaPath, logFilePath);
-
-        // Check synchronization completion
-        checkSyncCompletion(sourcePath, replicaPath, logFilePath);
-
-        auto end = std::chrono::steady_clock::now();
-        std::chrono::duration<double> elapsed_seconds = end - start;
+        // "**/name" is the same as an unanchored "name"
+        auto rest = literal(rule.tokens, 1);
+        if (rule.anchored && rule.tokens.size() > 1 && rule.tokens[0].type == TokenType::AnyDirs && rest
+            && rest->find('/') == String::npos) {
+            rule.tokens.erase(rule.tokens.begin());
+            rule.anchored = false;
+        }
 
-        // Sleep for the remaining interval
-        std::this_thread::sleep_for(std::chrono::seconds(interval) - elapsed_seconds);
+        int index = static_cast<int>(rules.size());
+        auto whole = literal(rule.tokens, 0);
+        auto suffix = literal(rule.tokens, 1);
+        if (whole) {
+            (rule.anchored ? literalPaths : literalNames)[*whole].update(index, rule.directoryOnly);
+        }
+        else if (!rule.anchored && rule.tokens[0].type == TokenType::AnyRun && suffix) {
+            suffixes[*suffix].update(index, rule.directoryOnly);
+            if (std::find(suffixLengths.begin(), suffixLengths.end(), suffix->size()) == suffixLengths.end()) {
+                suffixLengths.push_back(suffix->size());
+            }
+        }
+        else {
+            globs.push_back(index);
+        }
+        needsPath = needsPath || rule.anchored;
+        rules.push_back(std::move(rule));
+        return true;
     }
 
-    logOperation(logFilePath, "Synchronization stopped.");
-    return 0;
+    /**
+     * brief Add the rules of a gitignore-style file; blank lines and lines starting with '#' are skipped
+     * param path File to read
+     * return False if the file cannot be read or holds a malformed pattern
+     */
+    bool addFile(const fs::path& path) {
+        std::ifstream file(path);
+        if (!file.is_open()) {
+            return false;
+        }
+        std::string line;
+        while (std::getline(file, line)) {
+            while (!line.empty() && (line.back() == '\r' || line.back() == ' ' || line.back() == '\t')) {
+                line.pop_back();
+            }
+            if (line.empty() || line[0] == '#') {
+                continue;
+            }
+            if (!add(fs::path(line).native())) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool empty() const { return rules.empty(); }
+
+    /**
+     * brief Check whether an entry is excluded
+     * param parent Relative path of the directory holding the entry, empty for the roots
+     * param name Entry name
+     * param isDirectory Whether the entry is a directory
+     * return True if the last matching rule excludes the entry
+     */
+    bool excludes(const String& parent, const String& name, bool isDirectory) const {
+        if (rules.empty()) {
+            return false;
+        }
+        int best = -1;
+        auto lookup = [&](const std::unordered_map<String, Hit>& table, const String& key) {
+            auto it = table.find(key);
+            if (it != table.end()) {
+                best = std::max({ best, it->second.any, isDirectory ? it->second.directoryOnly : -1 });
+            }
+        };
+        lookup(literalNames, name);
+        for (size_t length : suffixLengths) {
+            if (name.size() >= length) {
+                lookup(suffixes, name.substr(name.size() - length));
+            }
+        }
+
+        String path;
+        if (needsPath) {
+            path = parent;
+            if (fs::path::preferred_separator != '/') {
+                std::replace(path.begin(), path.end(), static_cast<fs::path::value_type>(fs::path::preferred_separator), fs::path::value_type('/'));
+            }
+            if (!path.empty()) {
+                path += '/';
+            }
+            path += name;
+            lookup(literalPaths, path);
+        }
+        for (auto it = globs.rbegin(); it != globs.rend() && *it > best; ++it) {
+            const Rule& rule = rules[*it];
+            if ((isDirectory || !rule.directoryOnly) && match(rule.tokens, 0, rule.anchored ? path : name, 0)) {
+                best = *it;
+                break;
+            }
+        }
+        return best >= 0 && !rules[best].include;
+    }
+
+private:
+    enum class TokenType : std::uint8_t {
+        Literal,  ///< One character
+        AnyChar,  ///< '?'
+        AnyRun,   ///< '*': any run of characters within one path component
+        AnyDirs,  ///< Leading or inner "**/": zero or more whole directories
+        AnyPath,  ///< Trailing "/**": everything below
+        Class     ///< '[...]'
+    };
+
+    struct Token {
+        explicit Token(TokenType type, fs::path::value_type c = 0) : type(type), c(c) {}
+
+        TokenType type;
+        fs::path::value_type c;
+        bool negated = false;
+        std::vector<std::pair<fs::path::value_type, fs::path::value_type>> ranges;
+    };
+
+    struct Rule {
+        bool include = false;
+        bool directoryOnly = false;
+        bool anchored = false;
+        std::vector<Token> tokens;
+    };
+
+    /**
+     * brief Highest indices of the rules sharing a lookup key
+     */
+    struct Hit {
+        int any = -1;
+        int directoryOnly = -1;
+
+        void update(int index, bool forDirectories) {
+            (forDirectories ? directoryOnly : any) = index;
+        }
+    };
+
+    /**
+     * brief The text matched by tokens[first...] if they are all literal characters
+     */
+    static std::optional<String> literal(const std::vector<Token>& tokens, size_t first) {
+        String text;
+        for (size_t t = first; t < tokens.size(); ++t) {
+            if (tokens[t].type != TokenType::Literal) {
+                return std::nullopt;
+            }
+            text += tokens[t].c;
+        }
+        return text;
+    }
+
+    /**
+     * brief Turn a pattern body (without '!', leading and trailing '/') into tokens
+     */
+    static bool compile(const String& pattern, std::vector<Token>& tokens) {
+        for (size_t i = 0; i < pattern.size(); ++i) {
+            auto c = pattern[i];
+            if (c == '\\' && i + 1 < pattern.size()) {
+                tokens.emplace_back(TokenType::Literal, pattern[++i]);
+            }
+            else if (c == '*' && i + 1 < pattern.size() && pattern[i + 1] == '*') {
+                bool atStart = i == 0 || pattern[i - 1] == '/';
+                bool atEnd = i + 2 == pattern.size();
+                if (atStart && !atEnd && pattern[i + 2] == '/') {
+                    tokens.emplace_back(TokenType::AnyDirs);
+                    i += 2;
+                }
+                else if (atStart && atEnd && i > 0) {
+                    tokens.emplace_back(TokenType::AnyPath);
+                    ++i;
+                }
+                else {
+                    tokens.emplace_back(TokenType::AnyRun);
+                    ++i;
+                }
+            }
+            else if (c == '*') {
+                tokens.emplace_back(TokenType::AnyRun);
+            }
+            else if (c == '?') {
+                tokens.emplace_back(TokenType::AnyChar);
+            }
+            else if (c == '[') {
+                Token token(TokenType::Class);
+                size_t j = i + 1;
+                if (j < pattern.size() && (pattern[j] == '!' || pattern[j] == '^')) {
+                    token.negated = true;
+                    ++j;
+                }
+                for (bool first = true; j < pattern.size() && (first || pattern[j] != ']'); ++j, first = false) {
+                    auto low = pattern[j];
+                    if (j + 2 < pattern.size() && pattern[j + 1] == '-' && pattern[j + 2] != ']') {
+                        token.ranges.emplace_back(low, pattern[j + 2]);
+                        j += 2;
+                    }
+                    else {
+                        token.ranges.emplace_back(low, low);
+                    }
+                }
+                if (j == pattern.size()) {
+                    return false;  // Unterminated class
+                }
+                tokens.push_back(std::move(token));
+                i = j;
+            }
+            else {
+                tokens.emplace_back(TokenType::Literal, c);
+            }
+        }
+        return true;
+    }
+
+    /**
+     * brief Match tokens[t...] against text[s...]
+     */
+    static bool match(const std::vector<Token>& tokens, size_t t, const String& text, size_t s) {
+        for (; t < tokens.size(); ++t, ++s) {
+            const Token& token = tokens[t];
+            switch (token.type) {
+            case TokenType::AnyRun:
+                for (size_t end = s;; ++end) {
+                    if (match(tokens, t + 1, text, end)) {
+                        return true;
+                    }
+                    if (end == text.size() || text[end] == '/') {
+                        return false;
+                    }
+                }
+            case TokenType::AnyDirs:
+                if (match(tokens, t + 1, text, s)) {
+                    return true;
+                }
+                for (size_t end = s; end < text.size(); ++end) {
+                    if (text[end] == '/' && match(tokens, t + 1, text, end + 1)) {
+                        return true;
+                    }
+                }
+                return false;
+            case TokenType::AnyPath:
+                return s < text.size();
+            case TokenType::Literal:
+                if (s == text.size() || text[s] != token.c) {
+                    return false;
+                }
+                break;
+            case TokenType::AnyChar:
+                if (s == text.size() || text[s] == '/') {
+                    return false;
+                }
+                break;
+            case TokenType::Class: {
+                if (s == text.size() || text[s] == '/') {
+                    return false;
+                }
+                bool inClass = std::any_of(token.ranges.begin(), token.ranges.end(),
+                    [c = text[s]](const auto& range) { return range.first <= c && c <= range.second; });
+                if (inClass == token.negated) {
+                    return false;
+                }
+                break;
+            }
+            }
+        }
+        return s == text.size();
+    }
+
+    std::vector<Rule> rules;
+    std::unordered_map<String, Hit> literalNames;  ///< Unanchored patterns without wildcards
+    std::unordered_map<String, Hit> literalPaths;  ///< Anchored patterns without wildcards
+    std::unordered_map<String, Hit> suffixes;      ///< Unanchored "*suffix" patterns, keyed by suffix
+    std::vector<size_t> suffixLengths;             ///< Distinct suffix lengths to try
+    std::vector<int> globs;                        ///< Indices of the remaining rules, in order
+    bool needsPath = false;                        ///< Some rule is matched against the full relative path
+};
+
+class DeletionEngine;
+class Trash;
+class WalkerBudget;
+struct CycleStats;
+class DeviceLimiter;
+class ControlServer;
+class MetricsExporter;
+
+/**
+ * brief How much of a cycle's work is logged
+ */
+enum class Verbosity {
+    Summary,    ///< One summary line per cycle
+    Directory,  ///< One line per changed directory, plus the summary of cycles that changed something
+    File,       ///< One line per copied, created or removed entry, plus the summary of cycles that changed something
+};
+
+/**
+ * brief What the scheduler does when a cycle runs past the start of the next one
+ */
+enum class OverrunPolicy {
+    RunImmediately,  ///< Start the next cycle at once, then continue on the original schedule
+    SkipMissed,      ///< Wait for the next tick of the original schedule
+    BackOff,         ///< Double the time between cycles, up to 8 intervals, until cycles fit again
+};
+
+struct SyncOptions {
+    unsigned threads = 1;             ///< Worker threads for the tree walk
+    WalkerBudget* walkers = nullptr;  ///< Extra walker threads shared with the other pairs, if any
+    bool deterministicOrder = false;  ///< Emit log entries in serial walk order when walking in parallel
+    bool cacheListings = true;        ///< Reuse listings of directories whose stamp did not change
+    fs::path stateFile;               ///< Where the listing cache is persisted between runs (empty: not persisted)
+    bool watch = false;               ///< Sync on filesystem events, with full scans only every interval
+    std::chrono::milliseconds quietPeriod{ 500 };     ///< Watch mode: how long a path must go without events before it is synced
+    std::chrono::milliseconds maxStaleness{ 10000 };  ///< Watch mode: longest a changed path may wait for a quiet period
+    PathFilter filter;                ///< Entries left alone on both sides
+    unsigned deleteThreads = 4;       ///< Workers removing stale directories in the background (0: remove inline)
+    DeletionEngine* deletions = nullptr;  ///< Background deletion engine, if running
+    bool useTrash = false;            ///< Move removed entries into a trash directory in the replica
+    std::chrono::minutes trashRetention{ 24 * 60 };  ///< How long entries stay in the trash
+    Trash* trash = nullptr;           ///< Trash, if in use
+    std::chrono::milliseconds logFlushInterval{ 0 };  ///< Longest time log entries may stay unflushed (0: flush every batch)
+    bool logMilliseconds = false;     ///< Timestamp log entries to the millisecond
+    OverrunPolicy overrunPolicy = OverrunPolicy::RunImmediately;  ///< How a cycle longer than the interval is handled
+    std::chrono::seconds minInterval{ 1 };  ///< Adaptive interval: shortest time between cycles
+    std::chrono::seconds maxInterval{ 0 };  ///< Adaptive interval: longest time between cycles (0: fixed interval)
+    LogRotation logRotation;          ///< When the log and event log are rotated
+    Verbosity verbosity = Verbosity::File;  ///< What gets a log entry of its own
+    fs::path eventLogFile;            ///< JSON-lines event log (empty: none)
+    AsyncLogger* events = nullptr;    ///< Writer of the event log, if one is kept
+    fs::path reportFile;              ///< Rewritten with the statistics of every cycle (empty: none)
+    CycleStats* stats = nullptr;      ///< Counters of the pair's cycle in progress
+    std::string name;                 ///< Label of the pair in logs and reports (empty: the only pair)
+    DeviceLimiter* io = nullptr;      ///< Shared limit on hashing and copying per device, if any
+    std::uint64_t sourceDevice = 0;   ///< Device of the source root, for the limiter
+    std::uint64_t replicaDevice = 0;  ///< Device of the replica root, for the limiter
+    unsigned deviceIo = 0;            ///< Hashing and copying operations at once per device, across pairs (0: unlimited)
+    unsigned maxConcurrentPairs = 4;  ///< Most pair cycles running at once
+    fs::path controlSocket;           ///< Unix domain socket of the control interface (empty: none)
+    fs::path metricsFile;             ///< Prometheus textfile rewritten after every cycle (empty: none)
+    std::string metricsListen;        ///< [address:]port serving /metrics over HTTP (empty: none)
+    MetricsExporter* metrics = nullptr;  ///< Metrics exporter, if either is enabled
+};
+
+/**
+ * brief Counter split into cache-line-sized shards, so that threads adding to it do not contend
+ *
+ * Each thread adds to the shard it was given on first use and readers sum the shards, so the
+ * cost of a busy counter is paid by whoever reads it (a cycle summary or a metrics scrape)
+ * rather than by the walker threads. Like a relaxed atomic, a read that races with adds sees
+ * some of them.
+ */
+template <typename T>
+class ShardedCounter {
+public:
+    void add(T value) {
+        shards[shardIndex()].value.fetch_add(value, std::memory_order_relaxed);
+    }
+
+    T load(std::memory_order = std::memory_order_relaxed) const {
+        T sum = 0;
+        for (const auto& shard : shards) {
+            sum += shard.value.load(std::memory_order_relaxed);
+        }
+        return sum;
+    }
+
+    void store(T value, std::memory_order = std::memory_order_relaxed) {
+        for (auto& shard : shards) {
+            shard.value.store(0, std::memory_order_relaxed);
+        }
+        shards[0].value.store(value, std::memory_order_relaxed);
+    }
+
+    operator T() const {
+        return load();
+    }
+
+private:
+    static constexpr size_t shardCount = 16;
+
+    struct alignas(64) Shard {
+        std::atomic<T> value{ 0 };
+    };
+
+    static size_t shardIndex() {
+        static std::atomic<size_t> nextThread{ 0 };
+        thread_local size_t index = nextThread.fetch_add(1, std::memory_order_relaxed) % shardCount;
+        return index;
+    }
+
+    Shard shards[shardCount];
+};
+
+/**
+ * brief Counts of observations per bucket, as exported in a Prometheus histogram
+ */
+struct Histogram {
+    static constexpr std::array<double, 12> bounds = { 0.01, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60, 300 };  ///< Upper bounds, seconds
+
+    std::array<std::uint64_t, bounds.size() + 1> buckets{};  ///< Per bucket, not cumulative; the last one is +Inf
+    double sum = 0;
+    std::uint64_t count = 0;
+
+    void observe(double value) {
+        buckets[std::lower_bound(bounds.begin(), bounds.end(), value) - bounds.begin()] += 1;
+        sum += value;
+        ++count;
+    }
+};
+
+/**
+ * brief Work done by the current cycle, counted where it happens and logged as its summary
+ *
+ * The counters are bumped from the walker threads through per-thread shards; phase times of
+ * work done by several threads at once are the sum over the threads, so they can exceed the
+ * walk. Finished cycles are also added to running totals, which the metrics exporter reads.
+ */
+struct CycleStats {
+    /**
+     * brief Phases whose time is exported, in the order of Totals::phaseNs
+     */
+    static constexpr std::array<const char*, 4> phaseNames = { "scan", "compare", "copy", "delete" };
+
+    /**
+     * brief Everything counted since the start, for the metrics exporter
+     */
+    struct Totals {
+        std::uint64_t cycles = 0;
+        std::uint64_t directoriesScanned = 0;
+        std::uint64_t filesScanned = 0;
+        std::uint64_t filesHashed = 0;
+        std::uint64_t bytesHashed = 0;
+        std::uint64_t filesCopied = 0;
+        std::uint64_t bytesCopied = 0;
+        std::uint64_t entriesRemoved = 0;
+        std::uint64_t directoriesCreated = 0;
+        std::uint64_t errors = 0;
+        std::array<std::int64_t, phaseNames.size()> phaseNs{};  ///< Listing, hashing, copying and removing
+        Histogram cycleSeconds;                                  ///< Wall time of each cycle
+        std::array<Histogram, phaseNames.size()> phaseSeconds;   ///< Time of each phase per cycle
+        double lastFilesPerSecond = 0;                           ///< Source files examined per second of the last cycle
+        std::int64_t lastCycleMs = 0;                            ///< Unix time the last cycle finished, 0 before the first
+    };
+
+    ShardedCounter<std::uint64_t> directoriesScanned;
+    ShardedCounter<std::uint64_t> filesScanned;
+    ShardedCounter<std::uint64_t> filesHashed;
+    ShardedCounter<std::uint64_t> bytesHashed;
+    ShardedCounter<std::uint64_t> filesCopied;
+    ShardedCounter<std::uint64_t> bytesCopied;
+    ShardedCounter<std::uint64_t> entriesRemoved;        ///< Top-level entries only; a removed directory counts once
+    ShardedCounter<std::uint64_t> directoriesCreated;
+    ShardedCounter<std::uint64_t> errors;                ///< Entries or directories that could not be synchronized
+    ShardedCounter<std::uint64_t> sourceAdded;           ///< Source entries new since the last cycle, from the snapshot's change set
+    ShardedCounter<std::uint64_t> sourceRemoved;         ///< Source entries gone since the last cycle, from the snapshot's change set
+    ShardedCounter<std::int64_t> listingNs;
+    ShardedCounter<std::int64_t> hashingNs;
+    ShardedCounter<std::int64_t> copyingNs;
+    ShardedCounter<std::int64_t> removingNs;
+    ShardedCounter<std::int64_t> walkNs;                 ///< Wall time of the whole tree walk
+    ShardedCounter<std::int64_t> checkNs;                ///< Wall time of the completion check
+    ShardedCounter<std::int64_t> saveNs;                 ///< Wall time of saving the listing cache
+    std::atomic<std::uint64_t> overruns{ 0 };            ///< Cycles that ran past the next deadline, since the start; not reset
+    std::atomic<std::uint64_t> missedTicks{ 0 };         ///< Scheduled cycles that never ran, since the start; not reset
+    std::atomic<std::int64_t> intervalMs{ 0 };           ///< Interval the cycle was scheduled with; not reset
+    std::atomic<bool> changesMade{ false };              ///< Something changed since the last completion message; not reset
+    std::atomic<std::uint64_t> cycle{ 0 };               ///< Number of the cycle, counted from 1
+    std::atomic<std::int64_t> walkQueue{ 0 };            ///< Directories queued or being visited by the walk; not reset
+    std::atomic<std::int64_t> watchPending{ 0 };         ///< Watch mode: changed paths waiting to settle; not reset
+    std::atomic<std::int64_t> lastSyncedMs{ 0 };         ///< Unix time a cycle last left the replica complete, 0 before; not reset
+    std::chrono::system_clock::time_point started;        ///< When the cycle started
+
+    /**
+     * brief Add to a counter from any thread
+     */
+    template <typename T>
+    static void add(std::atomic<T>& counter, T value) {
+        counter.fetch_add(value, std::memory_order_relaxed);
+    }
+
+    template <typename T>
+    static void add(ShardedCounter<T>& counter, T value) {
+        counter.add(value);
+    }
+
+    /**
+     * brief Tell whether the cycle changed the replica
+     */
+    bool changed() const {
+        return filesCopied.load(std::memory_order_relaxed) + entriesRemoved.load(std::memory_order_relaxed)
+            + directoriesCreated.load(std::memory_order_relaxed) > 0;
+    }
+
+    /**
+     * brief Zero every counter at the start of a cycle
+     */
+    void reset() {
+        ++cycle;
+        started = std::chrono::system_clock::now();
+        for (auto* counter : { &directoriesScanned, &filesScanned, &filesHashed, &bytesHashed, &filesCopied, &bytesCopied,
+                 &entriesRemoved, &directoriesCreated, &errors, &sourceAdded, &sourceRemoved }) {
+            counter->store(0, std::memory_order_relaxed);
+        }
+        for (auto* counter : { &listingNs, &hashingNs, &copyingNs, &removingNs, &walkNs, &checkNs, &saveNs }) {
+            counter->store(0, std::memory_order_relaxed);
+        }
+        // Only now may readers of the totals add the (zeroed) counters of the new cycle
+        std::lock_guard<std::mutex> guard(totalsMutex);
+        inCycle = true;
+    }
+
+    /**
+     * brief Add the cycle that just ended to the totals
+     */
+    void finish() {
+        std::lock_guard<std::mutex> guard(totalsMutex);
+        addCycle(totals);
+        double seconds = static_cast<double>(walkNs.load() + checkNs.load() + saveNs.load()) / 1e9;
+        totals.cycles += 1;
+        totals.cycleSeconds.observe(seconds);
+        for (size_t phase = 0; phase < phaseNames.size(); ++phase) {
+            totals.phaseSeconds[phase].observe(static_cast<double>(phaseCounter(phase).load()) / 1e9);
+        }
+        totals.lastFilesPerSecond = seconds > 0 ? static_cast<double>(filesScanned.load()) / seconds : 0;
+        totals.lastCycleMs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+        inCycle = false;
+    }
+
+    /**
+     * brief Totals up to now, the cycle in progress included
+     */
+    Totals snapshot() const {
+        std::lock_guard<std::mutex> guard(totalsMutex);
+        Totals current = totals;
+        if (inCycle) {
+            addCycle(current);
+        }
+        return current;
+    }
+
+private:
+    const ShardedCounter<std::int64_t>& phaseCounter(size_t phase) const {
+        const ShardedCounter<std::int64_t>* counters[] = { &listingNs, &hashingNs, &copyingNs, &removingNs };
+        return *counters[phase];
+    }
+
+    void addCycle(Totals& target) const {
+        target.directoriesScanned += directoriesScanned;
+        target.filesScanned += filesScanned;
+        target.filesHashed += filesHashed;
+        target.bytesHashed += bytesHashed;
+        target.filesCopied += filesCopied;
+        target.bytesCopied += bytesCopied;
+        target.entriesRemoved += entriesRemoved;
+        target.directoriesCreated += directoriesCreated;
+        target.errors += errors;
+        for (size_t phase = 0; phase < phaseNames.size(); ++phase) {
+            target.phaseNs[phase] += phaseCounter(phase).load();
+        }
+    }
+
+    mutable std::mutex totalsMutex;
+    Totals totals;        ///< Finished cycles
+    bool inCycle = false; ///< A cycle is counting, and its counters are not in totals yet
+};
+
+/**
+ * brief Adds the time between its construction and destruction to a phase counter
+ */
+class PhaseTimer {
+public:
+    explicit PhaseTimer(ShardedCounter<std::int64_t>& total) : total(total), start(std::chrono::steady_clock::now()) {}
+
+    ~PhaseTimer() {
+        stop();
+    }
+
+    PhaseTimer(const PhaseTimer&) = delete;
+    PhaseTimer& operator=(const PhaseTimer&) = delete;
+
+    /**
+     * brief End the phase before the timer goes out of scope
+     * return Nanoseconds the phase took, or 0 if it had already ended
+     */
+    std::int64_t stop() {
+        if (!running) {
+            return 0;
+        }
+        running = false;
+        auto elapsed = static_cast<std::int64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+        CycleStats::add(total, elapsed);
+        return elapsed;
+    }
+
+private:
+    ShardedCounter<std::int64_t>& total;
+    std::chrono::steady_clock::time_point start;
+    bool running = true;
+};
+
+/**
+ * brief Builds one JSON object, field by field
+ */
+class JsonObject {
+public:
+    /**
+     * brief Add a string field, escaped as JSON requires
+     */
+    JsonObject& field(const char* name, const std::string& value) {
+        key(name);
+        text += '"';
+        for (unsigned char c : value) {
+            if (c == '"' || c == '\\') {
+                text += '\\';
+                text += static_cast<char>(c);
+            }
+            else if (c < 0x20) {
+                static const char hex[] = "0123456789abcdef";
+                text += "\\u00";
+                text += hex[c >> 4];
+                text += hex[c & 15];
+            }
+            else {
+                text += static_cast<char>(c);
+            }
+        }
+        text += '"';
+        return *this;
+    }
+
+    JsonObject& field(const char* name, const char* value) {
+        return field(name, std::string(value));
+    }
+
+    /**
+     * brief Add an integer field
+     */
+    template <typename T, typename = std::enable_if_t<std::is_integral_v<T>>>
+    JsonObject& field(const char* name, T value) {
+        key(name);
+        text += std::to_string(value);
+        return *this;
+    }
+
+    /**
+     * brief The finished object
+     */
+    std::string str() const {
+        return text + "}";
+    }
+
+private:
+    void key(const char* name) {
+        text += text.size() > 1 ? ",\"" : "\"";
+        text += name;
+        text += "\":";
+    }
+
+    std::string text = "{";
+};
+
+/**
+ * brief One operation of a cycle, as written to the event log
+ */
+struct SyncEvent {
+    const char* op;                  ///< copy, remove, trash, stage, mkdir, appeared, vanished or error
+    fs::path::string_type path;      ///< Path relative to both roots
+    std::int64_t bytes = -1;         ///< Bytes copied, if known
+    std::int64_t durationNs = -1;    ///< Time the operation took, if measured
+    std::string hash;                ///< SHA-256 of the source file, if it was computed
+    std::string error;               ///< What went wrong, for errors
+};
+
+/**
+ * brief Queue an event for the event log, if one is kept
+ *
+ * Events are formatted on the calling thread and written in batches by the event log's writer.
+ * param options Options holding the event log writer
+ * param event The event
+ */
+void logEvent(const SyncOptions& options, const SyncEvent& event) {
+    if (options.events == nullptr) {
+        return;
+    }
+    auto now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch());
+    JsonObject object;
+    object.field("time_ms", static_cast<std::int64_t>(now.count()));
+    if (!options.name.empty()) {
+        object.field("pair", options.name);
+    }
+    object.field("op", event.op).field("path", fs::path(event.path).generic_string());
+    if (event.bytes >= 0) {
+        object.field("bytes", event.bytes);
+    }
+    if (event.durationNs >= 0) {
+        object.field("duration_us", event.durationNs / 1000);
+    }
+    if (!event.hash.empty()) {
+        object.field("hash", event.hash);
+    }
+    if (!event.error.empty()) {
+        object.field("error", event.error);
+    }
+    options.events->push({}, object.str());
+}
+
+/**
+ * brief Limits how many hashing and copying operations run at once on each device, across all pairs
+ *
+ * Devices are identified by the st_dev of the pair roots. A copy holds a slot on the devices
+ * of both sides, taken in a fixed order so that two copies in opposite directions cannot
+ * deadlock; a copy within one device takes a single slot.
+ */
+class DeviceLimiter {
+public:
+    /**
+     * brief Create a limiter
+     * param perDevice Operations at once per device (0: unlimited)
+     */
+    explicit DeviceLimiter(unsigned perDevice) : perDevice(perDevice) {}
+
+    /**
+     * brief Change the number of operations at once per device; operations in progress carry on
+     */
+    void setLimit(unsigned limit) {
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            perDevice = limit;
+        }
+        released.notify_all();
+    }
+
+    /**
+     * brief Holds a slot on one or two devices for as long as it lives; does nothing without a limiter
+     */
+    class Slot {
+    public:
+        Slot(DeviceLimiter* limiter, std::uint64_t device) : Slot(limiter, device, device) {}
+
+        Slot(DeviceLimiter* limiter, std::uint64_t first, std::uint64_t second)
+            : limiter(limiter), low(std::min(first, second)), high(std::max(first, second)) {
+            if (limiter != nullptr) {
+                limiter->acquire(low);
+                if (high != low) {
+                    limiter->acquire(high);
+                }
+            }
+        }
+
+        ~Slot() {
+            if (limiter != nullptr) {
+                if (high != low) {
+                    limiter->release(high);
+                }
+                limiter->release(low);
+            }
+        }
+
+        Slot(const Slot&) = delete;
+        Slot& operator=(const Slot&) = delete;
+
+    private:
+        DeviceLimiter* limiter;
+        std::uint64_t low;
+        std::uint64_t high;
+    };
+
+private:
+    void acquire(std::uint64_t device) {
+        std::unique_lock<std::mutex> lock(mutex);
+        released.wait(lock, [&] { return perDevice == 0 || busy[device] < perDevice; });
+        ++busy[device];
+    }
+
+    void release(std::uint64_t device) {
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            --busy[device];
+        }
+        released.notify_all();
+    }
+
+    unsigned perDevice;  ///< 0: unlimited
+    std::mutex mutex;
+    std::condition_variable released;
+    std::unordered_map<std::uint64_t, unsigned> busy;  ///< Slots in use per device
+};
+
+/**
+ * brief Device a path lives on, or will live on once created
+ * param path Path; its nearest existing ancestor is used if it does not exist
+ * return Device id, or 0 where devices cannot be told apart
+ */
+std::uint64_t deviceOf(fs::path path) {
+#ifdef __linux__
+    path = fs::absolute(path);
+    for (;;) {
+        struct stat info;
+        if (stat(path.c_str(), &info) == 0) {
+            return static_cast<std::uint64_t>(info.st_dev);
+        }
+        if (!path.has_relative_path()) {
+            return 0;
+        }
+        path = path.parent_path();
+    }
+#else
+    (void)path;
+    return 0;
+#endif
+}
+
+#ifdef __linux__
+/**
+ * brief Throw a filesystem_error for the current errno
+ * param what Operation that failed
+ * param path Path the operation was applied to
+ */
+[[noreturn]] void throwErrno(const char* what, const fs::path& path) {
+    throw fs::filesystem_error(what, path, std::error_code(errno, std::system_category()));
+}
+
+/**
+ * brief Owned file descriptor, closed on destruction
+ */
+struct FileDescriptor {
+    int fd;
+
+    explicit FileDescriptor(int fd) : fd(fd) {}
+    FileDescriptor(const FileDescriptor&) = delete;
+    FileDescriptor& operator=(const FileDescriptor&) = delete;
+    ~FileDescriptor() {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+};
+
+/**
+ * brief Stat a single entry with statx, requesting only the fields in mask
+ * param dirFd Directory file descriptor (or AT_FDCWD)
+ * param name Entry name relative to dirFd, or an absolute path
+ * param flags statx flags (e.g. AT_SYMLINK_NOFOLLOW)
+ * param mask Fields the caller will read
+ * param path Path used in error reports
+ * return The filled statx buffer
+ */
+struct statx statEntry(int dirFd, const char* name, int flags, unsigned int mask, const fs::path::string_type& path) {
+    struct statx stx;
+    if (statx(dirFd, name, flags, mask, &stx) != 0) {
+        throwErrno("statx", path);
+    }
+    return stx;
+}
+
+/**
+ * brief Map a file mode to an EntryKind
+ */
+EntryKind kindFromMode(unsigned int mode) {
+    if (S_ISREG(mode)) {
+        return EntryKind::File;
+    }
+    if (S_ISDIR(mode)) {
+        return EntryKind::Directory;
+    }
+    return EntryKind::Other;
+}
+#endif
+
+/**
+ * brief An open directory of either tree
+ *
+ * On Linux the handle owns a directory file descriptor and the operations below are issued
+ * relative to it with the *at() system calls, so the kernel resolves a single name instead of
+ * the whole path. Elsewhere the handle only carries the path.
+ */
+struct DirHandle {
+    fs::path::string_type path;  ///< Directory path, for log messages and path-based platforms
+#ifdef __linux__
+    std::shared_ptr<FileDescriptor> fd;
+#endif
+
+    fs::path::string_type entryPath(const fs::path::string_type& name) const { return TreePath::join(path, name); }
+};
+
+/**
+ * brief Small LRU cache of open directories, shared by the workers of one cycle
+ *
+ * A directory is opened relative to its parent when the parent is still cached, which is the
+ * common case since parents are visited just before their children. Evicted handles stay
+ * valid for as long as a task still holds them.
+ */
+class DirectoryCache {
+public:
+    explicit DirectoryCache(size_t capacity = 128) : capacity(capacity) {}
+
+    /**
+     * brief Open a directory, reusing a cached handle when possible
+     * param path Directory path
+     * return Handle of the directory
+     */
+    DirHandle open(const fs::path::string_type& path) {
+#ifdef __linux__
+        std::shared_ptr<FileDescriptor> parent;
+        auto slash = path.find_last_of('/');
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            if (auto cached = lookup(path)) {
+                return { path, cached };
+            }
+            if (slash != fs::path::string_type::npos && slash > 0 && slash + 1 < path.size()) {
+                parent = lookup(path.substr(0, slash));
+            }
+        }
+
+        int fd = parent ? openat(parent->fd, path.c_str() + slash + 1, O_RDONLY | O_DIRECTORY | O_CLOEXEC)
+                        : ::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0) {
+            throwErrno("open", path);
+        }
+        auto handle = std::make_shared<FileDescriptor>(fd);
+
+        std::lock_guard<std::mutex> guard(mutex);
+        recent.emplace_front(path, handle);
+        index[path] = recent.begin();
+        if (recent.size() > capacity) {
+            index.erase(recent.back().first);
+            recent.pop_back();
+        }
+        return { path, handle };
+#else
+        return { path };
+#endif
+    }
+
+    /**
+     * brief Drop the cached handles of a directory and everything below it
+     *
+     * Called once the directory was removed or renamed away, so that a directory created
+     * later under the same name is opened afresh instead of through a handle of the old one.
+     * param path Directory path
+     */
+    void forget([[maybe_unused]] const fs::path::string_type& path) {
+#ifdef __linux__
+        std::lock_guard<std::mutex> guard(mutex);
+        for (auto it = recent.begin(); it != recent.end();) {
+            const auto& cached = it->first;
+            if (cached.compare(0, path.size(), path) == 0 && (cached.size() == path.size() || cached[path.size()] == '/')) {
+                index.erase(cached);
+                it = recent.erase(it);
+            }
+            else {
+                ++it;
+            }
+        }
+#endif
+    }
+
+private:
+#ifdef __linux__
+    using Entry = std::pair<fs::path::string_type, std::shared_ptr<FileDescriptor>>;
+
+    /**
+     * brief Find a cached descriptor and mark it most recently used; mutex must be held
+     */
+    std::shared_ptr<FileDescriptor> lookup(const fs::path::string_type& path) {
+        auto it = index.find(path);
+        if (it == index.end()) {
+            return nullptr;
+        }
+        recent.splice(recent.begin(), recent, it->second);
+        return it->second->second;
+    }
+
+    std::mutex mutex;
+    std::list<Entry> recent;  ///< Most recently used first
+    std::unordered_map<fs::path::string_type, std::list<Entry>::iterator> index;
+#endif
+    size_t capacity;
+};
+
+#ifdef __linux__
+/**
+ * brief Call a function for every entry of an open directory except "." and "..", in directory order
+ * param directory Directory to read from its start
+ * param visit Called with each entry's name and d_type
+ */
+template <typename Visit>
+void forEachDirent(const DirHandle& directory, Visit visit) {
+    struct linux_dirent64 {
+        ino64_t d_ino;
+        off64_t d_off;
+        unsigned short d_reclen;
+        unsigned char d_type;
+        char d_name[1];
+    };
+
+    int dirFd = directory.fd->fd;
+    if (lseek(dirFd, 0, SEEK_SET) < 0) {
+        throwErrno("lseek", directory.path);
+    }
+    alignas(linux_dirent64) char buffer[64 * 1024];
+    for (;;) {
+        long bytes = syscall(SYS_getdents64, dirFd, buffer, sizeof(buffer));
+        if (bytes < 0) {
+            throwErrno("getdents64", directory.path);
+        }
+        if (bytes == 0) {
+            break;
+        }
+        for (long offset = 0; offset < bytes;) {
+            auto* dirent = reinterpret_cast<linux_dirent64*>(buffer + offset);
+            offset += dirent->d_reclen;
+            const char* name = dirent->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+                continue;
+            }
+            visit(name, dirent->d_type);
+        }
+    }
+}
+#endif
+
+/**
+ * brief Read a single directory (non-recursively) and sort its entries by name
+ *
+ * On Linux the directory is read with getdents64 and classified from d_type; statx is only
+ * issued (asking for the type alone) for symlinks and filesystems that report DT_UNKNOWN.
+ * Elsewhere the type and size cached in each directory_entry are used.
+ * param directory Directory to list
+ * return Entries sorted by native name
+ */
+std::vector<ListingEntry> readListing(const DirHandle& directory) {
+    std::vector<ListingEntry> listing;
+#ifdef __linux__
+    int dirFd = directory.fd->fd;
+    forEachDirent(directory, [&](const char* name, unsigned char type) {
+        ListingEntry entry{ name, EntryKind::Other, true, unknownSize };
+        if (type == DT_UNKNOWN) {
+            auto stx = statEntry(dirFd, name, AT_SYMLINK_NOFOLLOW, STATX_TYPE, directory.entryPath(name));
+            type = S_ISLNK(stx.stx_mode) ? DT_LNK : DT_UNKNOWN;
+            entry.kind = kindFromMode(stx.stx_mode);
+        }
+        if (type == DT_REG) {
+            entry.kind = EntryKind::File;
+        }
+        else if (type == DT_DIR) {
+            entry.kind = EntryKind::Directory;
+        }
+        else if (type == DT_LNK) {
+            // Symlinks are mirrored by what they point to, but never descended into
+            struct statx stx;
+            if (statx(dirFd, name, 0, STATX_TYPE, &stx) == 0) {
+                entry.kind = kindFromMode(stx.stx_mode);
+            }
+            entry.descend = false;
+        }
+        listing.push_back(std::move(entry));
+    });
+#else
+    for (const auto& entry : fs::directory_iterator(directory.path)) {
+        EntryKind kind = EntryKind::Other;
+        std::uintmax_t size = unknownSize;
+        if (entry.is_regular_file()) {
+            kind = EntryKind::File;
+            size = entry.file_size();
+        }
+        else if (entry.is_directory()) {
+            kind = EntryKind::Directory;
+        }
+        listing.push_back({ entry.path().filename().native(), kind, !entry.is_symlink(), size });
+    }
+#endif
+    std::sort(listing.begin(), listing.end(), [](const ListingEntry& a, const ListingEntry& b) {
+        return a.name < b.name;
+    });
+    return listing;
+}
+
+/**
+ * brief Size of a listed file, read with a size-only statx when the listing did not provide it
+ * param directory Directory containing the file
+ * param entry Listing entry of the file
+ * return File size in bytes
+ */
+std::uintmax_t entrySize(const DirHandle& directory, const ListingEntry& entry) {
+    if (entry.size != unknownSize) {
+        return entry.size;
+    }
+#ifdef __linux__
+    return statEntry(directory.fd->fd, entry.name.c_str(), 0, STATX_SIZE, directory.entryPath(entry.name)).stx_size;
+#else
+    return fs::file_size(directory.entryPath(entry.name));
+#endif
+}
+
+/**
+ * brief Look up a single entry of an open directory, classified the way readListing would
+ * param directory Directory containing the entry
+ * param name Entry name
+ * param entry Receives the entry if it exists
+ * return False if there is no such entry
+ */
+bool readEntry(const DirHandle& directory, const fs::path::string_type& name, ListingEntry& entry) {
+    entry = { name, EntryKind::Other, true, unknownSize };
+#ifdef __linux__
+    struct statx stx;
+    if (statx(directory.fd->fd, name.c_str(), AT_SYMLINK_NOFOLLOW, STATX_TYPE | STATX_SIZE, &stx) != 0) {
+        if (errno == ENOENT || errno == ENOTDIR) {
+            return false;
+        }
+        throwErrno("statx", directory.entryPath(name));
+    }
+    if (S_ISLNK(stx.stx_mode)) {
+        entry.descend = false;
+        if (statx(directory.fd->fd, name.c_str(), 0, STATX_TYPE | STATX_SIZE, &stx) != 0) {
+            return true;
+        }
+    }
+    entry.kind = kindFromMode(stx.stx_mode);
+    if (entry.kind == EntryKind::File) {
+        entry.size = stx.stx_size;
+    }
+#else
+    fs::path path = directory.entryPath(name);
+    std::error_code error;
+    auto status = fs::symlink_status(path, error);
+    if (!fs::exists(status)) {
+        return false;
+    }
+    if (fs::is_symlink(status)) {
+        entry.descend = false;
+        status = fs::status(path, error);
+    }
+    if (fs::is_regular_file(status)) {
+        entry.kind = EntryKind::File;
+        entry.size = fs::file_size(path);
+    }
+    else if (fs::is_directory(status)) {
+        entry.kind = EntryKind::Directory;
+    }
+#endif
+    return true;
+}
+
+/**
+ * brief Compute SHA-256 hash of a file inside an open directory
+ * param directory Directory containing the file
+ * param name File name
+ * return SHA-256 hash as a string
+ */
+std::string computeFileHash(const DirHandle& directory, const fs::path::string_type& name) {
+#ifdef __linux__
+    FileDescriptor file(openat(directory.fd->fd, name.c_str(), O_RDONLY | O_CLOEXEC));
+    if (file.fd < 0) {
+        throwErrno("open", directory.entryPath(name));
+    }
+
+    std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)> context(EVP_MD_CTX_new(), EVP_MD_CTX_free);
+    EVP_DigestInit_ex(context.get(), EVP_sha256(), nullptr);
+    std::vector<unsigned char> buffer(256 * 1024);
+    for (;;) {
+        ssize_t bytes = read(file.fd, buffer.data(), buffer.size());
+        if (bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throwErrno("read", directory.entryPath(name));
+        }
+        if (bytes == 0) {
+            break;
+        }
+        EVP_DigestUpdate(context.get(), buffer.data(), static_cast<size_t>(bytes));
+    }
+
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+    EVP_DigestFinal_ex(context.get(), hash, nullptr);
+    std::ostringstream hashStream;
+    for (int i = 0; i < SHA256_DIGEST_LENGTH; ++i) {
+        hashStream << std::hex << std::setw(2) << std::setfill('0') << (int)hash[i];
+    }
+    return hashStream.str();
+#else
+    return computeFileHash(fs::path(directory.entryPath(name)));
+#endif
+}
+
+/**
+ * brief Copy a file between two open directories, replacing the target
+ * param sourceDir Directory containing the source file
+ * param replicaDir Directory receiving the copy
+ * param name File name, the same on both sides
+ * return Number of bytes copied
+ */
+std::uintmax_t copyFileAt(const DirHandle& sourceDir, const DirHandle& replicaDir, const fs::path::string_type& name) {
+#ifdef __linux__
+    FileDescriptor in(openat(sourceDir.fd->fd, name.c_str(), O_RDONLY | O_CLOEXEC));
+    if (in.fd < 0) {
+        throwErrno("open", sourceDir.entryPath(name));
+    }
+    struct stat sourceStat;
+    if (fstat(in.fd, &sourceStat) != 0) {
+        throwErrno("fstat", sourceDir.entryPath(name));
+    }
+    // A symlink in the replica is replaced, like fs::copy_file does, instead of writing through it
+    // to a file that may lie outside the replica
+    int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_NOFOLLOW;
+    FileDescriptor out(openat(replicaDir.fd->fd, name.c_str(), flags, 0600));
+    if (out.fd < 0 && errno == ELOOP) {
+        if (unlinkat(replicaDir.fd->fd, name.c_str(), 0) != 0) {
+            throwErrno("unlink", replicaDir.entryPath(name));
+        }
+        out.fd = openat(replicaDir.fd->fd, name.c_str(), flags, 0600);
+    }
+    if (out.fd < 0) {
+        throwErrno("open", replicaDir.entryPath(name));
+    }
+
+    // copy_file_range lets the kernel (or the filesystem, for reflinks) move the data; fall
+    // back to plain reads and writes where it is not supported
+    bool useCopyRange = true;
+    std::vector<char> buffer;
+    std::uintmax_t total = 0;
+    for (;;) {
+        ssize_t copied = -1;
+        if (useCopyRange) {
+            copied = copy_file_range(in.fd, nullptr, out.fd, nullptr, 1 << 30, 0);
+            if (copied < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) {
+                useCopyRange = false;
+                buffer.resize(256 * 1024);
+                continue;
+            }
+        }
+        else {
+            copied = read(in.fd, buffer.data(), buffer.size());
+            for (ssize_t written = 0; copied > 0 && written < copied;) {
+                ssize_t bytes = write(out.fd, buffer.data() + written, static_cast<size_t>(copied - written));
+                if (bytes < 0 && errno != EINTR) {
+                    throwErrno("write", replicaDir.entryPath(name));
+                }
+                written += std::max<ssize_t>(bytes, 0);
+            }
+        }
+        if (copied < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throwErrno(useCopyRange ? "copy_file_range" : "read", sourceDir.entryPath(name));
+        }
+        if (copied == 0) {
+            break;
+        }
+        total += static_cast<std::uintmax_t>(copied);
+    }
+    if (fchmod(out.fd, sourceStat.st_mode & 07777) != 0) {
+        throwErrno("fchmod", replicaDir.entryPath(name));
+    }
+    return total;
+#else
+    fs::copy_file(sourceDir.entryPath(name), replicaDir.entryPath(name), fs::copy_options::overwrite_existing);
+    return fs::file_size(replicaDir.entryPath(name));
+#endif
+}
+
+/**
+ * brief Create a directory inside an open directory
+ * param parent Directory to create it in
+ * param name Name of the new directory
+ */
+void makeDirectoryAt(const DirHandle& parent, const fs::path::string_type& name) {
+#ifdef __linux__
+    if (mkdirat(parent.fd->fd, name.c_str(), 0777) != 0) {
+        throwErrno("mkdir", parent.entryPath(name));
+    }
+#else
+    fs::create_directory(parent.entryPath(name));
+#endif
+}
+
+#ifdef __linux__
+/**
+ * brief Recursively remove everything inside an open directory
+ *
+ * Entries are taken straight from getdents64 without sorting or stat-ing them: directories
+ * reported by d_type are descended into directly, everything else is unlinked, and only an
+ * unlink failing with EISDIR (filesystems reporting DT_UNKNOWN) falls back to descending.
+ * Any other failure, EPERM for an immutable file included, is reported as it is.
+ * param directory Directory to empty
+ * return Number of entries removed
+ */
+std::uintmax_t removeContentsAt(const DirHandle& directory) {
+    int dirFd = directory.fd->fd;
+    std::vector<std::pair<std::string, bool>> entries;  ///< Names, and whether d_type says directory
+    forEachDirent(directory, [&](const char* name, unsigned char type) {
+        entries.emplace_back(name, type == DT_DIR);
+    });
+
+    std::uintmax_t removed = 0;
+    for (const auto& [name, isDirectory] : entries) {
+        if (!isDirectory) {
+            if (unlinkat(dirFd, name.c_str(), 0) == 0) {
+                ++removed;
+                continue;
+            }
+            if (errno == ENOENT) {
+                continue;
+            }
+            if (errno != EISDIR) {
+                throwErrno("unlink", directory.entryPath(name));
+            }
+        }
+        int childFd = openat(dirFd, name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (childFd < 0) {
+            throwErrno("open", directory.entryPath(name));
+        }
+        removed += removeContentsAt({ directory.entryPath(name), std::make_shared<FileDescriptor>(childFd) });
+        if (unlinkat(dirFd, name.c_str(), AT_REMOVEDIR) != 0) {
+            throwErrno("rmdir", directory.entryPath(name));
+        }
+        ++removed;
+    }
+    return removed;
+}
+#endif
+
+/**
+ * brief Remove a file or a whole directory tree inside an open directory
+ * param parent Directory containing the entry
+ * param name Entry name
+ * return Number of entries removed
+ */
+std::uintmax_t removeEntryAt(const DirHandle& parent, const fs::path::string_type& name) {
+#ifdef __linux__
+    int parentFd = parent.fd->fd;
+    if (unlinkat(parentFd, name.c_str(), 0) == 0) {
+        return 1;
+    }
+    if (errno == ENOENT) {
+        return 0;
+    }
+    if (errno != EISDIR) {
+        throwErrno("unlink", parent.entryPath(name));
+    }
+    int dirFd = openat(parentFd, name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (dirFd < 0) {
+        throwErrno("open", parent.entryPath(name));
+    }
+    std::uintmax_t removed = removeContentsAt({ parent.entryPath(name), std::make_shared<FileDescriptor>(dirFd) });
+    if (unlinkat(parentFd, name.c_str(), AT_REMOVEDIR) != 0) {
+        throwErrno("rmdir", parent.entryPath(name));
+    }
+    return removed + 1;
+#else
+    return fs::remove_all(parent.entryPath(name));
+#endif
+}
+
+#ifdef __linux__
+/**
+ * brief Removes directory trees in the background with a pool of workers
+ *
+ * A doomed directory is renamed into a staging directory at the replica root, a single rename
+ * on the same filesystem, and queued here, so the walk carries on with unrelated paths while
+ * the workers empty the tree. Every directory is a job of its own, so the workers spread over
+ * one large tree as well as over many small ones: a job unlinks the directory's files and
+ * queues its subdirectories, and the job finishing a directory's last child removes it. Trees
+ * left behind by an interrupted run are picked up again at startup. Workers are started only
+ * when jobs outnumber the idle ones and exit after a while without work, so an engine that
+ * has nothing to delete holds no thread.
+ */
+class DeletionEngine {
+public:
+    static constexpr const char* stagingName = ".syncfolders-deleting";  ///< Staging directory at the replica root, never synchronized
+
+    /**
+     * brief Create an engine; no thread runs until something is queued
+     * param replicaRoot Replica directory path
+     * param threads Number of worker threads
+     * param logFilePath Path to the log file
+     * param verbosity Verbosity of the run; at summary verbosity removed trees are not logged one by one
+     */
+    DeletionEngine(const fs::path& replicaRoot, unsigned threads, const std::string& logFilePath, Verbosity verbosity)
+        : stagingPath(TreePath::join(replicaRoot.native(), stagingName)), threads(std::max(threads, 1u)), logFilePath(logFilePath), verbosity(verbosity),
+          runPrefix(std::to_string(std::chrono::system_clock::to_time_t(std::chrono::system_clock::now()))) {}
+
+    ~DeletionEngine() {
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& worker : workers) {
+            worker.thread.join();
+        }
+    }
+
+    DeletionEngine(const DeletionEngine&) = delete;
+    DeletionEngine& operator=(const DeletionEngine&) = delete;
+
+    /**
+     * brief Queue whatever an earlier run left in the staging directory
+     */
+    void start() {
+        std::lock_guard<std::mutex> guard(stagingMutex);
+        int fd = ::open(stagingPath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0) {
+            return;
+        }
+        staging = std::make_shared<FileDescriptor>(fd);
+        try {
+            forEachDirent({ stagingPath, staging }, [&](const char* name, unsigned char) {
+                if (unlinkat(staging->fd, name, 0) != 0) {
+                    queueTree(name, TreePath::join(stagingPath, name));
+                }
+            });
+        }
+        catch (const fs::filesystem_error& e) {
+            logOperation(logFilePath, "Filesystem error: " + std::string(e.what()));
+        }
+        removeStagingIfIdle();
+    }
+
+    /**
+     * brief Move a directory out of the replica and queue it for removal
+     * param parent Directory containing the entry
+     * param name Entry name
+     * return False if the entry is not a directory or cannot be moved, in which case the caller removes it
+     */
+    bool stage(const DirHandle& parent, const fs::path::string_type& name) {
+        struct statx stx;
+        if (statx(parent.fd->fd, name.c_str(), AT_SYMLINK_NOFOLLOW, STATX_TYPE, &stx) != 0 || !S_ISDIR(stx.stx_mode)) {
+            return false;
+        }
+        std::lock_guard<std::mutex> guard(stagingMutex);
+        if (!staging) {
+            if (mkdir(stagingPath.c_str(), 0700) != 0 && errno != EEXIST) {
+                return false;
+            }
+            int fd = ::open(stagingPath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (fd < 0) {
+                return false;
+            }
+            staging = std::make_shared<FileDescriptor>(fd);
+        }
+        std::string staged = runPrefix + "-" + std::to_string(++stagedCount);
+        // Fails with EXDEV for a mount point below the replica root
+        if (renameat(parent.fd->fd, name.c_str(), staging->fd, staged.c_str()) != 0) {
+            return false;
+        }
+        queueTree(staged, parent.entryPath(name));
+        return true;
+    }
+
+    /**
+     * brief Number of directories waiting for a worker
+     */
+    size_t backlog() const {
+        std::lock_guard<std::mutex> guard(mutex);
+        return jobs.size();
+    }
+
+    /**
+     * brief Log how far background deletion has come, if any is outstanding
+     */
+    void reportProgress() {
+        size_t trees = activeTrees;
+        if (trees > 0) {
+            logOperation(logFilePath, "Background deletion: " + std::to_string(removedTotal.load()) + " entries removed so far, "
+                + std::to_string(trees) + (trees == 1 ? " tree" : " trees") + " in progress");
+        }
+    }
+
+private:
+    struct Tree {
+        std::string path;  ///< Where the tree was in the replica, for the log
+        std::atomic<std::uintmax_t> removed{ 0 };
+        std::atomic<bool> failed{ false };
+    };
+
+    struct Job {
+        std::shared_ptr<Job> parent;         ///< Directory holding this one, nullptr for a staged tree
+        std::string name;                    ///< Name in the parent, or in the staging directory
+        std::string path;                    ///< For error reports
+        std::shared_ptr<Tree> tree;
+        std::shared_ptr<FileDescriptor> fd;  ///< Opened when the job runs, kept until its children are done
+        std::atomic<size_t> pending{ 1 };    ///< The job's own listing plus its unfinished subdirectories
+    };
+
+    struct Worker {
+        std::thread thread;
+        bool done = false;  ///< The worker went idle for too long and returned; set under mutex
+    };
+
+    static constexpr std::chrono::seconds idleTimeout{ 10 };  ///< How long a worker waits for a job before it exits
+
+    /**
+     * brief Start a worker if jobs outnumber the idle ones and the limit allows; mutex must be held
+     */
+    void addWorkerIfNeeded() {
+        for (auto it = workers.begin(); it != workers.end();) {
+            if (it->done) {
+                it->thread.join();
+                it = workers.erase(it);
+            }
+            else {
+                ++it;
+            }
+        }
+        if (jobs.size() > idleWorkers && workers.size() < threads) {
+            workers.emplace_back();
+            workers.back().thread = std::thread(&DeletionEngine::work, this, &workers.back());
+        }
+    }
+
+    void queueTree(const std::string& stagedName, const std::string& originalPath) {
+        auto job = std::make_shared<Job>();
+        job->name = stagedName;
+        job->path = TreePath::join(stagingPath, stagedName);
+        job->tree = std::make_shared<Tree>();
+        job->tree->path = originalPath;
+        ++activeTrees;
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            jobs.push_back(std::move(job));
+            addWorkerIfNeeded();
+        }
+        wake.notify_one();
+    }
+
+    void work(Worker* self) {
+        for (;;) {
+            std::shared_ptr<Job> job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                ++idleWorkers;
+                bool ready = wake.wait_for(lock, idleTimeout, [this] { return stopping || !jobs.empty(); });
+                --idleWorkers;
+                if (stopping || !ready) {
+                    self->done = true;
+                    return;
+                }
+                // Depth first, so that few directories are open at once
+                job = std::move(jobs.back());
+                jobs.pop_back();
+            }
+            try {
+                run(job);
+            }
+            catch (const fs::filesystem_error& e) {
+                // The tree stays in the staging directory and is retried on the next start
+                logOperation(logFilePath, "Filesystem error: " + std::string(e.what()));
+                if (!job->tree->failed.exchange(true)) {
+                    --activeTrees;
+                }
+            }
+        }
+    }
+
+    /**
+     * brief Unlink the files of one directory and queue its subdirectories
+     */
+    void run(const std::shared_ptr<Job>& job) {
+        int parentFd = job->parent ? job->parent->fd->fd : staging->fd;
+        int fd = openat(parentFd, job->name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd < 0) {
+            throwErrno("open", job->path);
+        }
+        job->fd = std::make_shared<FileDescriptor>(fd);
+
+        std::vector<std::pair<std::string, bool>> entries;  ///< Names, and whether d_type says directory
+        forEachDirent({ job->path, job->fd }, [&](const char* name, unsigned char type) {
+            entries.emplace_back(name, type == DT_DIR);
+        });
+        std::vector<std::shared_ptr<Job>> children;
+        std::uintmax_t removed = 0;
+        for (const auto& [name, isDirectory] : entries) {
+            if (!isDirectory) {
+                if (unlinkat(fd, name.c_str(), 0) == 0) {
+                    ++removed;
+                    continue;
+                }
+                if (errno == ENOENT) {
+                    continue;
+                }
+                if (errno != EISDIR) {
+                    throwErrno("unlink", TreePath::join(job->path, name));
+                }
+            }
+            auto child = std::make_shared<Job>();
+            child->parent = job;
+            child->name = name;
+            child->path = TreePath::join(job->path, name);
+            child->tree = job->tree;
+            ++job->pending;
+            children.push_back(std::move(child));
+        }
+        job->tree->removed += removed;
+        removedTotal += removed;
+        if (!children.empty()) {
+            {
+                std::lock_guard<std::mutex> guard(mutex);
+                for (auto& child : children) {
+                    jobs.push_back(std::move(child));
+                }
+                addWorkerIfNeeded();
+            }
+            wake.notify_all();
+        }
+        finish(job);
+    }
+
+    /**
+     * brief Account for a finished listing or subdirectory, removing directories that are now empty
+     */
+    void finish(std::shared_ptr<Job> job) {
+        while (job && --job->pending == 0) {
+            int parentFd = job->parent ? job->parent->fd->fd : staging->fd;
+            job->fd.reset();
+            if (unlinkat(parentFd, job->name.c_str(), AT_REMOVEDIR) != 0) {
+                throwErrno("rmdir", job->path);
+            }
+            ++job->tree->removed;
+            ++removedTotal;
+            if (!job->parent) {
+                if (verbosity != Verbosity::Summary) {
+                    logOperation(logFilePath, "Removed: " + fs::path(job->tree->path).string() + " ("
+                        + std::to_string(job->tree->removed.load()) + " entries, in the background)");
+                }
+                std::lock_guard<std::mutex> guard(stagingMutex);
+                --activeTrees;
+                removeStagingIfIdle();
+            }
+            job = job->parent;
+        }
+    }
+
+    /**
+     * brief Remove the staging directory once nothing is staged, so the replica matches the source; stagingMutex must be held
+     */
+    void removeStagingIfIdle() {
+        if (staging && activeTrees == 0 && unlinkat(AT_FDCWD, stagingPath.c_str(), AT_REMOVEDIR) == 0) {
+            staging.reset();
+        }
+    }
+
+    std::string stagingPath;
+    unsigned threads;
+    std::string logFilePath;
+    Verbosity verbosity;
+    std::string runPrefix;  ///< Keeps staged names unique across runs
+
+    std::mutex stagingMutex;
+    std::shared_ptr<FileDescriptor> staging;  ///< Opened on first use
+    std::uint64_t stagedCount = 0;
+
+    mutable std::mutex mutex;
+    std::condition_variable wake;
+    std::vector<std::shared_ptr<Job>> jobs;
+    std::list<Worker> workers;  ///< A list, since each worker keeps a pointer to its own entry
+    size_t idleWorkers = 0;
+    bool stopping = false;
+
+    std::atomic<size_t> activeTrees{ 0 };
+    std::atomic<std::uintmax_t> removedTotal{ 0 };
+};
+#endif
+
+/**
+ * brief Copy a source file to the replica if it is missing or its content differs
+ *
+ * Files whose sizes differ are copied without hashing either side.
+ * param sourceDir Source directory containing the file
+ * param replicaDir Replica directory mirroring sourceDir
+ * param relative Path of both directories relative to their roots
+ * param sourceEntry Listing entry of the source file
+ * param replicaEntry Listing entry of the replica file, or nullptr if the replica does not have it
+ * param logFilePath Path to the log file
+ * param options Verbosity and event log of the cycle
+ * return True if the file was copied
+ */
+bool syncCopy(const DirHandle& sourceDir, const DirHandle& replicaDir, const fs::path::string_type& relative,
+    const ListingEntry& sourceEntry, const ListingEntry* replicaEntry, const std::string& logFilePath, const SyncOptions& options) {
+    const auto& name = sourceEntry.name;
+    bool shouldCopy = false;
+    std::string sourceHash;
+    if (replicaEntry == nullptr) {
+        shouldCopy = true;
+    }
+    else {
+        std::uintmax_t size = entrySize(sourceDir, sourceEntry);
+        if (size != entrySize(replicaDir, *replicaEntry)) {
+            shouldCopy = true;
+        }
+        else {
+            PhaseTimer timer(options.stats->hashingNs);
+            std::string replicaHash;
+            {
+                DeviceLimiter::Slot slot(options.io, options.sourceDevice);
+                sourceHash = computeFileHash(sourceDir, name);
+            }
+            {
+                DeviceLimiter::Slot slot(options.io, options.replicaDevice);
+                replicaHash = computeFileHash(replicaDir, name);
+            }
+            CycleStats::add<std::uint64_t>(options.stats->filesHashed, 2);
+            CycleStats::add<std::uint64_t>(options.stats->bytesHashed, 2 * static_cast<std::uint64_t>(size));
+            if (sourceHash != replicaHash) {
+                shouldCopy = true;
+            }
+        }
+    }
+
+    if (shouldCopy) {
+        PhaseTimer timer(options.stats->copyingNs);
+        std::uintmax_t bytes = 0;
+        {
+            DeviceLimiter::Slot slot(options.io, options.sourceDevice, options.replicaDevice);
+            bytes = copyFileAt(sourceDir, replicaDir, name);
+        }
+        std::int64_t duration = timer.stop();
+        logEvent(options, { "copy", TreePath::join(relative, name), static_cast<std::int64_t>(bytes), duration, sourceHash, {} });
+        CycleStats::add<std::uint64_t>(options.stats->filesCopied, 1);
+        CycleStats::add<std::uint64_t>(options.stats->bytesCopied, bytes);
+        if (options.verbosity == Verbosity::File) {
+            logOperation(logFilePath, "Copied file: " + fs::path(sourceDir.entryPath(name)).string() + " to " + fs::path(replicaDir.entryPath(name)).string());
+        }
+        options.stats->changesMade = true;
+    }
+    return shouldCopy;
+}
+
+/**
+ * brief Trash directory in the replica that removed entries are moved into instead of being deleted
+ *
+ * Entries removed during a cycle are renamed to .syncfolders-trash/<cycle>/<relative path>
+ * on the same filesystem, so removing costs the same however large the entry is, and an
+ * accidental deletion in the source can be undone by moving the entry back. Cycle directories
+ * are named after the local time the cycle first moved something; the TrashReclaimer shared
+ * by every pair deletes those older than the retention period, including ones from earlier runs.
+ */
+class Trash {
+public:
+    static constexpr const char* trashName = ".syncfolders-trash";  ///< Trash directory at the replica root, never synchronized
+
+    /**
+     * brief Create a trash; nothing is purged until it is added to a TrashReclaimer
+     * param replicaRoot Replica directory path
+     * param retention How long removed entries are kept
+     * param logFilePath Path to the log file
+     */
+    Trash(const fs::path& replicaRoot, std::chrono::seconds retention, const std::string& logFilePath)
+        : replicaRoot(replicaRoot.native()), trashPath(replicaRoot / trashName), retention(retention), logFilePath(logFilePath) {}
+
+    Trash(const Trash&) = delete;
+    Trash& operator=(const Trash&) = delete;
+
+    /**
+     * brief How often expired cycle directories are looked for
+     */
+    std::chrono::seconds period() const {
+        return std::clamp<std::chrono::seconds>(retention, std::chrono::seconds(1), std::chrono::seconds(60));
+    }
+
+    /**
+     * brief Delete the cycle directories older than the retention period
+     */
+    void purgeExpired() {
+        std::vector<fs::path> expired;
+        std::vector<fs::path> unparsed;
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            std::error_code error;
+            for (fs::directory_iterator it(trashPath, error), end; !error && it != end; it.increment(error)) {
+                std::string name = it->path().filename().string();
+                std::tm created{};
+                std::istringstream stream(name);
+                stream >> std::get_time(&created, "%Y%m%d-%H%M%S");
+                if (stream.fail()) {
+                    // Not a cycle directory; its age is unknown, so it is left alone
+                    if (std::find(ignored.begin(), ignored.end(), name) == ignored.end()) {
+                        ignored.push_back(name);
+                        unparsed.push_back(it->path());
+                    }
+                    continue;
+                }
+                created.tm_isdst = -1;
+                std::time_t createdTime = std::mktime(&created);
+                if (name != cycle && createdTime != -1
+                    && std::chrono::system_clock::now() - std::chrono::system_clock::from_time_t(createdTime) >= retention) {
+                    expired.push_back(it->path());
+                }
+            }
+        }
+
+        for (const auto& path : unparsed) {
+            logOperation(logFilePath, "Error: Unable to parse trash entry name, not purging it: " + path.string());
+        }
+        for (const auto& path : expired) {
+            try {
+                std::uintmax_t removed = fs::remove_all(path);
+                logOperation(logFilePath, "Purged from trash: " + path.string() + " (" + std::to_string(removed) + " entries)");
+            }
+            catch (const fs::filesystem_error& e) {
+                logOperation(logFilePath, "Filesystem error: " + std::string(e.what()));
+            }
+        }
+    }
+
+    /**
+     * brief Make the next removal open a new cycle directory
+     */
+    void beginCycle() {
+        std::lock_guard<std::mutex> guard(mutex);
+        cycle.clear();
+    }
+
+    /**
+     * brief Move a replica entry into the current cycle directory
+     * param parent Directory containing the entry
+     * param name Entry name
+     * param error Receives why the entry could not be moved
+     * return Where the entry went, or an empty path if it could not be moved and was left in place
+     */
+    fs::path move(const DirHandle& parent, const fs::path::string_type& name, std::error_code& error) {
+        size_t prefix = replicaRoot.size();
+        if (prefix > 0 && replicaRoot.back() != '/' && replicaRoot.back() != fs::path::preferred_separator) {
+            ++prefix;
+        }
+        fs::path::string_type relative = parent.path.size() > prefix ? parent.path.substr(prefix) : fs::path::string_type();
+        std::lock_guard<std::mutex> guard(mutex);
+        if (cycle.empty()) {
+            cycle = cycleName();
+        }
+        fs::path target = trashPath / cycle / relative;
+        fs::create_directories(target, error);
+        if (error) {
+            return fs::path();
+        }
+        target /= name;
+        // The same path can be removed more than once in a cycle, e.g. in watch mode
+        std::error_code missing;
+        for (int copy = 1; fs::exists(fs::symlink_status(target, missing)); ++copy) {
+            target.replace_filename(name);
+            target += "." + std::to_string(copy);
+        }
+        fs::rename(parent.entryPath(name), target, error);
+        return error ? fs::path() : target;
+    }
+
+private:
+    /**
+     * brief Name for a new cycle directory: the local time, made unique if a cycle already used it
+     */
+    std::string cycleName() const {
+        std::time_t now = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+        std::tm local{};
+#ifdef _WIN32
+        localtime_s(&local, &now);
+#else
+        localtime_r(&now, &local);
+#endif
+        std::ostringstream name;
+        name << std::put_time(&local, "%Y%m%d-%H%M%S");
+        std::string base = name.str();
+        std::string unique = base;
+        std::error_code error;
+        for (int n = 2; fs::exists(trashPath / unique, error); ++n) {
+            unique = base + "-" + std::to_string(n);
+        }
+        return unique;
+    }
+
+    fs::path::string_type replicaRoot;
+    fs::path trashPath;
+    std::chrono::seconds retention;
+    std::string logFilePath;
+
+    std::mutex mutex;
+    std::string cycle;  ///< Directory of the current cycle, empty until it moves something
+    std::vector<std::string> ignored;  ///< Entries whose names are not cycle times, reported once each
+};
+
+/**
+ * brief One low-priority thread purging the trashes of every pair
+ *
+ * The thread starts with the first trash added and visits each trash as often as its
+ * retention calls for. Trashes are held weakly, so a pair going away needs no deregistration.
+ */
+class TrashReclaimer {
+public:
+    TrashReclaimer() = default;
+
+    ~TrashReclaimer() {
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        if (reclaimer.joinable()) {
+            reclaimer.join();
+        }
+    }
+
+    TrashReclaimer(const TrashReclaimer&) = delete;
+    TrashReclaimer& operator=(const TrashReclaimer&) = delete;
+
+    /**
+     * brief Purge a trash from now on, starting the thread if it is the first one
+     * param trash Trash of a pair
+     */
+    void add(const std::shared_ptr<Trash>& trash) {
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            trashes.push_back({ trash, std::chrono::steady_clock::now() });
+            added = true;
+            if (!reclaimer.joinable()) {
+                reclaimer = std::thread(&TrashReclaimer::reclaim, this);
+            }
+        }
+        wake.notify_all();
+    }
+
+private:
+    struct Entry {
+        std::weak_ptr<Trash> trash;
+        std::chrono::steady_clock::time_point due;  ///< When the trash is next purged
+    };
+
+    /**
+     * brief Background thread: purge every trash as it falls due until stopped
+     */
+    void reclaim() {
+        lowerThreadPriority();
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!stopping) {
+            added = false;
+            auto next = std::chrono::steady_clock::now() + std::chrono::seconds(60);
+            // Only this thread erases entries, so indices stay valid while the lock is released
+            for (size_t i = 0; i < trashes.size() && !stopping;) {
+                std::shared_ptr<Trash> trash = trashes[i].trash.lock();
+                if (!trash) {
+                    trashes.erase(trashes.begin() + static_cast<std::ptrdiff_t>(i));
+                    continue;
+                }
+                if (trashes[i].due <= std::chrono::steady_clock::now()) {
+                    lock.unlock();
+                    trash->purgeExpired();
+                    lock.lock();
+                    trashes[i].due = std::chrono::steady_clock::now() + trash->period();
+                }
+                next = std::min(next, trashes[i].due);
+                ++i;
+            }
+            wake.wait_until(lock, next, [this] { return stopping || added; });
+        }
+    }
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::vector<Entry> trashes;
+    bool added = false;     ///< A trash was added since the last pass
+    bool stopping = false;
+    std::thread reclaimer;
+};
+
+/**
+ * brief Names at the replica root that belong to the synchronizer rather than to the source
+ *
+ * They are left out of the replica's root listing only; a source entry of the same name is
+ * not filtered but reported, since it cannot be synchronized over them. The trash is reserved
+ * even when it is not in use, so that a run without --trash never deletes what an earlier run
+ * put there.
+ * param options Deletion engine of the pair
+ * return The reserved names
+ */
+std::vector<fs::path::string_type> reservedReplicaNames([[maybe_unused]] const SyncOptions& options) {
+    std::vector<fs::path::string_type> names{ fs::path(Trash::trashName).native() };
+#ifdef __linux__
+    if (options.deletions != nullptr) {
+        names.push_back(DeletionEngine::stagingName);
+    }
+#endif
+    return names;
+}
+
+/**
+ * brief Remove a replica entry that has no counterpart in the source
+ *
+ * A directory is removed with everything below it and logged once, with the number of
+ * entries that went with it; the walk never descends into it. With a trash the entry is
+ * moved into it instead; if that fails the entry is left in place and reported as an error,
+ * never removed, so the next cycle tries again. With a deletion engine a directory is only
+ * moved aside here and removed in the background.
+ * param replicaDir Replica directory containing the entry
+ * param relative Path of replicaDir relative to the replica root
+ * param name Entry name
+ * param logFilePath Path to the log file
+ * param options Trash, deletion engine, verbosity and event log of the cycle
+ */
+void syncDelete(const DirHandle& replicaDir, const fs::path::string_type& relative, const fs::path::string_type& name,
+    const std::string& logFilePath, const SyncOptions& options) {
+    PhaseTimer timer(options.stats->removingNs);
+    bool logEntry = options.verbosity == Verbosity::File;
+    if (options.trash != nullptr) {
+        std::error_code error;
+        fs::path target = options.trash->move(replicaDir, name, error);
+        if (target.empty()) {
+            std::string message = "Unable to move to trash, left in place: " + fs::path(replicaDir.entryPath(name)).string() + ": " + error.message();
+            logOperation(logFilePath, "Error: " + message);
+            logEvent(options, { "error", TreePath::join(relative, name), -1, -1, {}, message });
+            CycleStats::add<std::uint64_t>(options.stats->errors, 1);
+            return;
+        }
+        logEvent(options, { "trash", TreePath::join(relative, name), -1, timer.stop(), {}, {} });
+        CycleStats::add<std::uint64_t>(options.stats->entriesRemoved, 1);
+        if (logEntry) {
+            logOperation(logFilePath, "Moved to trash: " + fs::path(replicaDir.entryPath(name)).string() + " to " + target.string());
+        }
+        options.stats->changesMade = true;  // Flag changes
+        return;
+    }
+#ifdef __linux__
+    if (options.deletions != nullptr && options.deletions->stage(replicaDir, name)) {
+        logEvent(options, { "stage", TreePath::join(relative, name), -1, timer.stop(), {}, {} });
+        CycleStats::add<std::uint64_t>(options.stats->entriesRemoved, 1);
+        if (logEntry) {
+            logOperation(logFilePath, "Removing in the background: " + fs::path(replicaDir.entryPath(name)).string());
+        }
+        options.stats->changesMade = true;  // Flag changes
+        return;
+    }
+#endif
+    std::uintmax_t removed = removeEntryAt(replicaDir, name);
+    logEvent(options, { "remove", TreePath::join(relative, name), -1, timer.stop(), {}, {} });
+    CycleStats::add<std::uint64_t>(options.stats->entriesRemoved, 1);
+    if (logEntry) {
+        std::string message = "Removed: " + fs::path(replicaDir.entryPath(name)).string();
+        if (removed > 1) {
+            message += " (" + std::to_string(removed) + " entries)";
+        }
+        logOperation(logFilePath, message);
+    }
+    options.stats->changesMade = true;  // Flag changes
+}
+
+/**
+ * brief What a cycle changed in one replica directory, for the directory-level log
+ */
+struct DirectoryChanges {
+    std::uint64_t copied = 0;
+    std::uint64_t removed = 0;
+    std::uint64_t created = 0;
+
+    /**
+     * brief Log the changes of a replica directory, if there were any
+     * param replica Replica directory path
+     * param logFilePath Path to the log file
+     */
+    void log(const fs::path::string_type& replica, const std::string& logFilePath) const {
+        if (copied + removed + created > 0) {
+            logOperation(logFilePath, "Synchronized directory: " + fs::path(replica).string() + " (" + std::to_string(copied)
+                + " copied, " + std::to_string(removed) + " removed, " + std::to_string(created) + " created)");
+        }
+    }
+};
+
+/**
+ * brief Modification and change times of a directory, used to tell whether its listing changed
+ */
+struct DirStamp {
+    std::int64_t mtimeSec = 0;
+    std::uint32_t mtimeNsec = 0;
+    std::int64_t ctimeSec = 0;   ///< Not available through std::filesystem; stays 0 there
+    std::uint32_t ctimeNsec = 0;
+    bool racy = false;           ///< Too close to the time it was read to rule out a change within the same clock tick
+
+    bool operator==(const DirStamp& other) const {
+        return mtimeSec == other.mtimeSec && mtimeNsec == other.mtimeNsec && ctimeSec == other.ctimeSec && ctimeNsec == other.ctimeNsec;
+    }
+};
+
+/// A stamp must be at least this much older than the moment it was read to be trusted; file
+/// times come from a coarse clock, and FAT only keeps them to 2 seconds
+constexpr std::chrono::seconds racyStampWindow(2);
+
+/**
+ * brief Read the stamp of an open directory
+ *
+ * On Linux this is a statx on the directory fd asking for mtime and ctime only. As with
+ * git's racy-clean rule, a stamp that is not clearly older than the time it was read is
+ * marked racy: a change made later within the same clock tick would leave it unchanged.
+ * param directory Directory to stamp
+ * return The directory's stamp
+ */
+DirStamp readDirStamp(const DirHandle& directory) {
+    DirStamp stamp;
+#ifdef __linux__
+    auto readTime = std::chrono::system_clock::now();
+    auto stx = statEntry(directory.fd->fd, "", AT_EMPTY_PATH, STATX_MTIME | STATX_CTIME, directory.path);
+    stamp.mtimeSec = stx.stx_mtime.tv_sec;
+    stamp.mtimeNsec = stx.stx_mtime.tv_nsec;
+    stamp.ctimeSec = stx.stx_ctime.tv_sec;
+    stamp.ctimeNsec = stx.stx_ctime.tv_nsec;
+    auto latest = std::chrono::system_clock::time_point(std::chrono::duration_cast<std::chrono::system_clock::duration>(
+        std::chrono::seconds(std::max(stamp.mtimeSec, stamp.ctimeSec))));
+    stamp.racy = latest + racyStampWindow > readTime;
+#else
+    auto readTime = fs::file_time_type::clock::now();
+    auto mtime = fs::last_write_time(directory.path);
+    stamp.mtimeSec = static_cast<std::int64_t>(mtime.time_since_epoch().count());
+    stamp.racy = mtime + racyStampWindow > readTime;
+#endif
+    return stamp;
+}
+
+/**
+ * brief FNV-1a digest of a listing's names and kinds
+ * param listing Listing to digest
+ * return 64-bit digest
+ */
+std::uint64_t listingDigest(const std::vector<ListingEntry>& listing) {
+    std::uint64_t digest = 14695981039346656037ull;
+    auto mix = [&digest](std::uint64_t value) {
+        digest ^= value;
+        digest *= 1099511628211ull;
+    };
+    for (const auto& entry : listing) {
+        for (auto c : entry.name) {
+            mix(static_cast<std::uint64_t>(c));
+        }
+        mix(0x100u + static_cast<std::uint64_t>(entry.kind));
+    }
+    return digest;
+}
+
+/**
+ * brief Entries that appeared in or disappeared from a tree since the previous cycle
+ *
+ * Only the topmost changed entry is listed: a new directory appears once, not with every
+ * entry below it.
+ */
+struct ChangeSet {
+    std::vector<fs::path::string_type> added;    ///< Relative paths of new entries
+    std::vector<fs::path::string_type> removed;  ///< Relative paths of vanished entries
+};
+
+/**
+ * brief Compact snapshot of one directory tree, carried from cycle to cycle
+ *
+ * Nodes live in one arena and refer to their names through an interned string pool, and
+ * each directory's children are a contiguous, name-sorted block of nodes. No path is stored
+ * anywhere: a walk task carries the id of its directory and asks for its children's ids.
+ * With 12 bytes per node and names stored once, 10M entries fit in a few hundred MB.
+ *
+ * Each directory keeps the stamp it had when its listing was taken, so an unchanged directory
+ * is served from the snapshot instead of the filesystem. Only names and kinds are kept; file
+ * sizes and contents are still checked every cycle. Directories holding symlinks are never
+ * served from the snapshot, since retargeting a link does not touch the directory, and neither
+ * are listings stored under a racy stamp (see readDirStamp). Replacing
+ * a listing diffs it against the old one, which yields the tree's change set directly.
+ */
+class TreeSnapshot {
+public:
+    using Id = std::uint32_t;
+    static constexpr Id none = static_cast<Id>(-1);
+    static constexpr Id root = 0;  ///< Id of the root directory
+    static constexpr fs::path::value_type separators[] = { '/', fs::path::preferred_separator, 0 };
+
+    /**
+     * brief Create an empty snapshot
+     * param recordChanges Collect a change set whenever a known listing is replaced
+     */
+    explicit TreeSnapshot(bool recordChanges = false) : recordChanges(recordChanges) {
+        clear();
+    }
+
+    /**
+     * brief Get a directory's listing if the directory is unchanged since it was stored
+     * param directory Directory id
+     * param stamp Current stamp of the directory
+     * param listing Receives the listing on success
+     * return True if the snapshot's listing can be used
+     */
+    bool lookup(Id directory, const DirStamp& stamp, std::vector<ListingEntry>& listing) const {
+        if (directory == none) {
+            return false;
+        }
+        std::lock_guard<std::mutex> guard(mutex);
+        const auto& record = directories[directory];
+        if (!record.valid || !(record.stamp == stamp)) {
+            return false;
+        }
+        listing.clear();
+        listing.reserve(record.childCount);
+        for (Id i = record.firstChild; i < record.firstChild + record.childCount; ++i) {
+            listing.push_back({ name(nodes[i].name), static_cast<EntryKind>(nodes[i].kind), true, unknownSize });
+        }
+        return true;
+    }
+
+    /**
+     * brief Replace a directory's listing with a freshly read one
+     * param directory Directory id
+     * param stamp Stamp read before the listing
+     * param listing The listing, sorted by name
+     * param relative Relative path of the directory, for the change set
+     */
+    void store(Id directory, const DirStamp& stamp, const std::vector<ListingEntry>& listing, const fs::path::string_type& relative) {
+        if (directory == none) {
+            return;
+        }
+        std::lock_guard<std::mutex> guard(mutex);
+        auto old = directories[directory];
+        Id firstChild = static_cast<Id>(nodes.size());
+        Id o = old.firstChild;
+        Id oldEnd = old.firstChild + old.childCount;
+        for (const auto& entry : listing) {
+            // Both blocks are sorted, so matching old children is a merge
+            while (o < oldEnd && name(nodes[o].name) < entry.name) {
+                noteChange(old, changes.removed, relative, nodes[o++].name);
+            }
+            Node node{ intern(entry.name), none, static_cast<std::uint8_t>(entry.kind) };
+            bool existed = o < oldEnd && nodes[o].name == node.name;
+            if (existed && nodes[o].kind == node.kind) {
+                node.directory = nodes[o].directory;
+            }
+            else {
+                if (existed) {
+                    noteChange(old, changes.removed, relative, node.name);
+                }
+                noteChange(old, changes.added, relative, node.name);
+                if (entry.kind == EntryKind::Directory) {
+                    node.directory = static_cast<Id>(directories.size());
+                    directories.emplace_back();
+                }
+            }
+            if (existed) {
+                ++o;
+            }
+            nodes.push_back(node);
+        }
+        while (o < oldEnd) {
+            noteChange(old, changes.removed, relative, nodes[o++].name);
+        }
+
+        auto& record = directories[directory];
+        garbage += record.childCount;
+        record.firstChild = firstChild;
+        record.childCount = static_cast<Id>(listing.size());
+        record.stamp = stamp;
+        record.listed = true;
+        record.valid = !stamp.racy && std::all_of(listing.begin(), listing.end(), [](const ListingEntry& entry) { return entry.descend; });
+        record.digest = listingDigest(listing);
+    }
+
+    /**
+     * brief Stop serving a directory's listing, e.g. after the cycle changed the directory
+     *
+     * The children stay in place so that their subdirectories keep their own listings.
+     */
+    void invalidate(Id directory) {
+        if (directory == none) {
+            return;
+        }
+        std::lock_guard<std::mutex> guard(mutex);
+        directories[directory].valid = false;
+    }
+
+    /**
+     * brief Id of a subdirectory as recorded in its parent's listing
+     * param directory Parent directory id
+     * param childName Name of the subdirectory
+     * return The subdirectory's id, or none if the snapshot does not know it as a directory
+     */
+    Id child(Id directory, const fs::path::string_type& childName) const {
+        if (directory == none) {
+            return none;
+        }
+        std::lock_guard<std::mutex> guard(mutex);
+        const auto& record = directories[directory];
+        auto first = nodes.begin() + record.firstChild;
+        auto last = first + record.childCount;
+        auto it = std::lower_bound(first, last, childName, [this](const Node& node, const fs::path::string_type& value) {
+            return name(node.name) < value;
+        });
+        return it != last && name(it->name) == childName ? it->directory : none;
+    }
+
+    /**
+     * brief Id of a directory given its relative path, by walking down from the root
+     * param relative Relative path, empty for the root
+     * return The directory's id, or none if the snapshot does not know it
+     */
+    Id resolve(const fs::path::string_type& relative) const {
+        Id directory = root;
+        size_t start = 0;
+        while (directory != none && start < relative.size()) {
+            size_t end = relative.find_first_of(separators, start);
+            if (end == fs::path::string_type::npos) {
+                end = relative.size();
+            }
+            if (end > start) {
+                directory = child(directory, relative.substr(start, end - start));
+            }
+            start = end + 1;
+        }
+        return directory;
+    }
+
+    /**
+     * brief Hand over the changes collected since the last call
+     */
+    ChangeSet takeChanges() {
+        std::lock_guard<std::mutex> guard(mutex);
+        ChangeSet taken = std::move(changes);
+        changes = {};
+        return taken;
+    }
+
+    /**
+     * brief Number of live entries in the snapshot
+     */
+    size_t size() const {
+        std::lock_guard<std::mutex> guard(mutex);
+        return nodes.size() - garbage;
+    }
+
+    /**
+     * brief Drop replaced listings and unreachable directories once they make up half the arena
+     *
+     * Ids change, so this must only run between cycles.
+     */
+    void compact() {
+        std::lock_guard<std::mutex> guard(mutex);
+        if (garbage < 4096 || garbage * 2 < nodes.size()) {
+            return;
+        }
+        TreeSnapshot compacted(recordChanges);
+        compacted.directories[root] = directories[root];
+        copyChildren(compacted, root);
+        nodes = std::move(compacted.nodes);
+        directories = std::move(compacted.directories);
+        chars = std::move(compacted.chars);
+        nameStart = std::move(compacted.nameStart);
+        nameSlots = std::move(compacted.nameSlots);
+        garbage = 0;
+    }
+
+    /**
+     * brief Forget everything, leaving an empty tree
+     */
+    void reset() {
+        std::lock_guard<std::mutex> guard(mutex);
+        clear();
+        changes = {};
+    }
+
+    /**
+     * brief Serialize the snapshot (without its change set)
+     */
+    void write(std::ofstream& file) const {
+        std::lock_guard<std::mutex> guard(mutex);
+        writeVector(file, chars);
+        writeVector(file, nameStart);
+        writeValue<std::uint64_t>(file, nodes.size());
+        for (const auto& node : nodes) {
+            writeValue(file, node.name);
+            writeValue(file, node.directory);
+            writeValue(file, node.kind);
+        }
+        writeValue<std::uint64_t>(file, directories.size());
+        for (const auto& record : directories) {
+            writeValue(file, record.firstChild);
+            writeValue(file, record.childCount);
+            writeValue(file, record.stamp.mtimeSec);
+            writeValue(file, record.stamp.mtimeNsec);
+            writeValue(file, record.stamp.ctimeSec);
+            writeValue(file, record.stamp.ctimeNsec);
+            writeValue(file, record.digest);
+            writeValue<std::uint8_t>(file, (record.valid ? 1 : 0) | (record.listed ? 2 : 0));
+        }
+        writeValue<std::uint64_t>(file, garbage);
+    }
+
+    /**
+     * brief Replace the snapshot with one written by write()
+     *
+     * Out-of-range or backward references reject the whole snapshot; a listing whose digest does not
+     * match is merely no longer served.
+     * return False if the data was truncated or inconsistent
+     */
+    bool read(std::ifstream& file) {
+        TreeSnapshot loaded(recordChanges);
+        std::uint64_t count = 0;
+        if (!readVector(file, loaded.chars) || !readVector(file, loaded.nameStart) || loaded.nameStart.empty()
+            || loaded.nameStart.back() != loaded.chars.size() || !readValue(file, count)) {
+            return false;
+        }
+        Id names = static_cast<Id>(loaded.nameStart.size() - 1);
+        if (!std::is_sorted(loaded.nameStart.begin(), loaded.nameStart.end())) {
+            return false;
+        }
+        loaded.nodes.resize(count);
+        for (auto& node : loaded.nodes) {
+            if (!readValue(file, node.name) || !readValue(file, node.directory) || !readValue(file, node.kind) || node.name >= names
+                || node.kind > static_cast<std::uint8_t>(EntryKind::Other)) {
+                return false;
+            }
+        }
+        if (!readValue(file, count) || count == 0) {
+            return false;
+        }
+        loaded.directories.resize(count);
+        for (auto& record : loaded.directories) {
+            std::uint8_t flags = 0;
+            if (!readValue(file, record.firstChild) || !readValue(file, record.childCount) || !readValue(file, record.stamp.mtimeSec)
+                || !readValue(file, record.stamp.mtimeNsec) || !readValue(file, record.stamp.ctimeSec)
+                || !readValue(file, record.stamp.ctimeNsec) || !readValue(file, record.digest) || !readValue(file, flags)
+                || static_cast<std::uint64_t>(record.firstChild) + record.childCount > loaded.nodes.size()) {
+                return false;
+            }
+            record.valid = (flags & 1) != 0;
+            record.listed = (flags & 2) != 0;
+        }
+        for (const auto& node : loaded.nodes) {
+            if (node.directory != none && node.directory >= loaded.directories.size()) {
+                return false;
+            }
+        }
+        // A subdirectory always gets a later record than its parent, so a reference back to the
+        // directory itself or an earlier one can only come from a corrupt file and would loop the walk
+        for (Id id = 0; id < loaded.directories.size(); ++id) {
+            const auto& record = loaded.directories[id];
+            for (Id i = record.firstChild; i < record.firstChild + record.childCount; ++i) {
+                if (loaded.nodes[i].directory != none && loaded.nodes[i].directory <= id) {
+                    return false;
+                }
+            }
+        }
+        if (!readValue(file, loaded.garbage)) {
+            return false;
+        }
+
+        loaded.rebuildNameIndex();
+        std::vector<ListingEntry> listing;
+        for (Id id = 0; id < loaded.directories.size(); ++id) {
+            auto& record = loaded.directories[id];
+            if (record.valid) {
+                listing.clear();
+                for (Id i = record.firstChild; i < record.firstChild + record.childCount; ++i) {
+                    listing.push_back({ loaded.name(loaded.nodes[i].name), static_cast<EntryKind>(loaded.nodes[i].kind), true, unknownSize });
+                }
+                record.valid = listingDigest(listing) == record.digest;
+            }
+        }
+
+        std::lock_guard<std::mutex> guard(mutex);
+        nodes = std::move(loaded.nodes);
+        directories = std::move(loaded.directories);
+        chars = std::move(loaded.chars);
+        nameStart = std::move(loaded.nameStart);
+        nameSlots = std::move(loaded.nameSlots);
+        garbage = loaded.garbage;
+        changes = {};
+        return true;
+    }
+
+private:
+    struct Node {
+        Id name;               ///< Interned name
+        Id directory;          ///< Directory record of a subdirectory, none for other entries
+        std::uint8_t kind;     ///< EntryKind
+    };
+
+    struct Directory {
+        Id firstChild = 0;     ///< First node of the name-sorted child block
+        Id childCount = 0;
+        DirStamp stamp;        ///< Stamp read before the listing was taken
+        std::uint64_t digest = 0;
+        bool valid = false;    ///< Listing may be served while the stamp matches
+        bool listed = false;   ///< A listing was stored at some point (changes are diffed against it)
+    };
+
+    /**
+     * brief Reset to an empty tree holding only the root directory
+     */
+    void clear() {
+        nodes.clear();
+        directories.assign(1, Directory{});
+        chars.clear();
+        nameStart.assign(1, 0);
+        nameSlots.assign(1024, none);
+        garbage = 0;
+    }
+
+    /**
+     * brief Name of an interned id
+     */
+    fs::path::string_type name(Id id) const {
+        return fs::path::string_type(chars.data() + nameStart[id], nameStart[id + 1] - nameStart[id]);
+    }
+
+    static std::uint64_t hashName(const fs::path::value_type* data, size_t length) {
+        std::uint64_t hash = 14695981039346656037ull;
+        for (size_t i = 0; i < length; ++i) {
+            hash ^= static_cast<std::uint64_t>(data[i]);
+            hash *= 1099511628211ull;
+        }
+        return hash;
+    }
+
+    /**
+     * brief Intern a name in the string pool (open addressing over name ids)
+     */
+    Id intern(const fs::path::string_type& value) {
+        size_t mask = nameSlots.size() - 1;
+        for (size_t slot = hashName(value.data(), value.size()) & mask;; slot = (slot + 1) & mask) {
+            Id id = nameSlots[slot];
+            if (id == none) {
+                id = static_cast<Id>(nameStart.size() - 1);
+                chars.insert(chars.end(), value.begin(), value.end());
+                nameStart.push_back(static_cast<Id>(chars.size()));
+                nameSlots[slot] = id;
+                if ((id + 1) * 2 > nameSlots.size()) {
+                    rebuildNameIndex();
+                }
+                return id;
+            }
+            if (nameStart[id + 1] - nameStart[id] == value.size()
+                && std::equal(value.begin(), value.end(), chars.begin() + nameStart[id])) {
+                return id;
+            }
+        }
+    }
+
+    /**
+     * brief Rebuild the intern table with room for twice the current names
+     */
+    void rebuildNameIndex() {
+        size_t names = nameStart.size() - 1;
+        size_t capacity = 1024;
+        while (capacity < names * 4) {
+            capacity *= 2;
+        }
+        nameSlots.assign(capacity, none);
+        for (Id id = 0; id < names; ++id) {
+            size_t slot = hashName(chars.data() + nameStart[id], nameStart[id + 1] - nameStart[id]) & (capacity - 1);
+            while (nameSlots[slot] != none) {
+                slot = (slot + 1) & (capacity - 1);
+            }
+            nameSlots[slot] = id;
+        }
+    }
+
+    /**
+     * brief Record a change in the current change set, if this directory had a listing to diff against
+     */
+    void noteChange(const Directory& old, std::vector<fs::path::string_type>& list, const fs::path::string_type& relative, Id nameId) {
+        if (recordChanges && old.listed) {
+            list.push_back(relative.empty() ? name(nameId) : TreePath::join(relative, name(nameId)));
+        }
+    }
+
+    /**
+     * brief Copy a directory's reachable subtree into another snapshot (used by compact)
+     */
+    void copyChildren(TreeSnapshot& target, Id directory) const {
+        std::vector<std::pair<Id, Id>> pending{ { directory, directory } };  // (source id, target id)
+        while (!pending.empty()) {
+            auto [from, to] = pending.back();
+            pending.pop_back();
+            const auto& record = directories[from];
+            Id firstChild = static_cast<Id>(target.nodes.size());
+            for (Id i = record.firstChild; i < record.firstChild + record.childCount; ++i) {
+                Node node{ target.intern(name(nodes[i].name)), none, nodes[i].kind };
+                if (nodes[i].directory != none) {
+                    node.directory = static_cast<Id>(target.directories.size());
+                    target.directories.push_back(directories[nodes[i].directory]);
+                    pending.emplace_back(nodes[i].directory, node.directory);
+                }
+                target.nodes.push_back(node);
+            }
+            target.directories[to].firstChild = firstChild;
+            target.directories[to].childCount = record.childCount;
+        }
+    }
+
+    template <typename T>
+    static void writeValue(std::ofstream& file, const T& value) {
+        file.write(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    template <typename T>
+    static bool readValue(std::ifstream& file, T& value) {
+        return static_cast<bool>(file.read(reinterpret_cast<char*>(&value), sizeof(value)));
+    }
+
+    template <typename T>
+    static void writeVector(std::ofstream& file, const std::vector<T>& values) {
+        writeValue<std::uint64_t>(file, values.size());
+        file.write(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(T));
+    }
+
+    template <typename T>
+    static bool readVector(std::ifstream& file, std::vector<T>& values) {
+        std::uint64_t size = 0;
+        if (!readValue(file, size) || size > (std::uint64_t(1) << 34) / sizeof(T)) {
+            return false;
+        }
+        values.resize(size);
+        return static_cast<bool>(file.read(reinterpret_cast<char*>(values.data()), size * sizeof(T)));
+    }
+
+    mutable std::mutex mutex;
+    std::vector<Node> nodes;                   ///< Arena of all entries
+    std::vector<Directory> directories;        ///< Directory records, indexed by directory id
+    std::vector<fs::path::value_type> chars;   ///< Interned names, back to back
+    std::vector<Id> nameStart;                 ///< Start of each name in chars, plus a final end offset
+    std::vector<Id> nameSlots;                 ///< Open-addressing intern table of name ids
+    std::uint64_t garbage = 0;                 ///< Nodes in replaced child blocks
+    bool recordChanges;
+    ChangeSet changes;
+};
+
+/**
+ * brief Snapshots of the source and replica trees of a sync pair
+ *
+ * Replica listings are only stored for directories a cycle left untouched, and only the
+ * source snapshot records change sets.
+ */
+struct PairSnapshot {
+    TreeSnapshot source{ true };
+    TreeSnapshot replica;
+
+    /**
+     * brief Save both snapshots to a state file
+     * param path State file path
+     * param sourceRoot Source root the snapshots belong to
+     * param replicaRoot Replica root the snapshots belong to
+     * return False if the file could not be written
+     */
+    bool save(const fs::path& path, const fs::path& sourceRoot, const fs::path& replicaRoot) const {
+        fs::path temporary = path;
+        temporary += ".tmp";
+        {
+            std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+            if (!file.is_open()) {
+                return false;
+            }
+            file.write(stateMagic, sizeof(stateMagic));
+            writeRoot(file, sourceRoot);
+            writeRoot(file, replicaRoot);
+            source.write(file);
+            replica.write(file);
+            if (!file.good()) {
+                return false;
+            }
+        }
+        std::error_code error;
+        fs::rename(temporary, path, error);
+        return !error;
+    }
+
+    /**
+     * brief Load a state file written by save(); files for another source or replica root are ignored
+     * param path State file path
+     * param sourceRoot Source root the snapshots belong to
+     * param replicaRoot Replica root the snapshots belong to
+     * return Number of source entries loaded
+     */
+    size_t load(const fs::path& path, const fs::path& sourceRoot, const fs::path& replicaRoot) {
+        std::ifstream file(path, std::ios::binary);
+        char magic[sizeof(stateMagic)];
+        if (!file.read(magic, sizeof(magic)) || !std::equal(magic, magic + sizeof(magic), stateMagic)
+            || !readRoot(file, sourceRoot) || !readRoot(file, replicaRoot)) {
+            return 0;
+        }
+        if (!source.read(file) || !replica.read(file)) {
+            source.reset();
+            replica.reset();
+            return 0;
+        }
+        return source.size();
+    }
+
+private:
+    static constexpr char stateMagic[8] = { 'S', 'F', 'S', 'N', 'A', 'P', '0', '3' };
+
+    /**
+     * brief Write a root path, length first
+     */
+    static void writeRoot(std::ofstream& file, const fs::path& root) {
+        std::uint32_t length = static_cast<std::uint32_t>(root.native().size());
+        file.write(reinterpret_cast<const char*>(&length), sizeof(length));
+        file.write(reinterpret_cast<const char*>(root.native().data()), length * sizeof(fs::path::value_type));
+    }
+
+    /**
+     * brief Read a root written by writeRoot()
+     * return False if it could not be read or is not the expected root
+     */
+    static bool readRoot(std::ifstream& file, const fs::path& expected) {
+        std::uint32_t length = 0;
+        if (!file.read(reinterpret_cast<char*>(&length), sizeof(length)) || length != expected.native().size()) {
+            return false;
+        }
+        fs::path::string_type saved(length, fs::path::value_type());
+        return file.read(reinterpret_cast<char*>(saved.data()), length * sizeof(fs::path::value_type)) && saved == expected.native();
+    }
+};
+
+/**
+ * brief A directory pair waiting to be synchronized
+ */
+struct WalkTask {
+    TreePath path;                                       ///< Source and replica paths of the pair
+    bool replicaIsNew;                                   ///< True if the replica directory was just created and is known to be empty
+    TreeSnapshot::Id sourceNode = TreeSnapshot::root;    ///< Source directory in the snapshot
+    TreeSnapshot::Id replicaNode = TreeSnapshot::root;   ///< Replica directory in the snapshot
+};
+
+/**
+ * brief Synchronize one directory pair by merge-joining both sorted listings
+ *
+ * Entries present on only one side, or with a different kind on each side, are resolved
+ * from the join itself, so no per-entry existence check is needed. Replica-only entries are
+ * removed before anything is created so that names differing only by case do not collide
+ * on case-insensitive filesystems. Listings of directories whose stamp is unchanged since the
+ * previous cycle come from the snapshot instead of the filesystem. Excluded entries are dropped
+ * from both listings before the join, so they are neither copied, removed nor descended into.
+ * param task The directory pair
+ * param directories Open directory cache of the cycle
+ * param snapshot Tree snapshots carried across cycles, or nullptr to always read listings
+ * param options Include/exclude rules and deletion engine of the cycle
+ * param logFilePath Path to the log file
+ * param children Receives the subdirectory pairs to descend into, in name order
+ */
+void syncDirectoryPair(const WalkTask& task, DirectoryCache& directories, PairSnapshot* snapshot, const SyncOptions& options,
+    const std::string& logFilePath, std::vector<WalkTask>& children) {
+    const TreePath& directory = task.path;
+    const PathFilter& filter = options.filter;
+    bool replicaIsNew = task.replicaIsNew;
+    struct Subdirectory {
+        fs::path::string_type name;
+        bool create;  ///< Missing in the replica
+    };
+    std::vector<ListingEntry> sourceListing;
+    std::vector<ListingEntry> replicaListing;
+    std::vector<ListingEntry> unfilteredReplica;  ///< What the snapshot keeps, so that changing the rules never hides an entry
+    std::vector<fs::path::string_type> toRemove;
+    std::vector<std::pair<size_t, size_t>> toCopy;  ///< Source and replica listing indices (npos if missing)
+    std::vector<Subdirectory> subdirectories;
+    std::vector<ListingEntry> expectedReplica;  ///< Replica listing once the operations below are done
+    DirStamp replicaStamp;
+    bool replicaCached = false;
+    bool replicaModified = replicaIsNew;
+    bool failed = false;
+
+    try {
+        DirHandle sourceDir = directories.open(directory.source);
+        DirHandle replicaDir = directories.open(directory.replica);
+        PhaseTimer listingTimer(options.stats->listingNs);
+        if (snapshot == nullptr) {
+            sourceListing = readListing(sourceDir);
+            if (!replicaIsNew) {
+                replicaListing = readListing(replicaDir);
+            }
+        }
+        else {
+            // Stamps are read before the listings so that a change racing the read shows up next cycle
+            DirStamp sourceStamp = readDirStamp(sourceDir);
+            if (!snapshot->source.lookup(task.sourceNode, sourceStamp, sourceListing)) {
+                sourceListing = readListing(sourceDir);
+                snapshot->source.store(task.sourceNode, sourceStamp, sourceListing, directory.relative);
+            }
+            if (!replicaIsNew) {
+                replicaStamp = readDirStamp(replicaDir);
+                replicaCached = snapshot->replica.lookup(task.replicaNode, replicaStamp, replicaListing);
+                if (!replicaCached) {
+                    replicaListing = readListing(replicaDir);
+                }
+            }
+        }
+        listingTimer.stop();
+        CycleStats::add<std::uint64_t>(options.stats->directoriesScanned, 1);
+        CycleStats::add<std::uint64_t>(options.stats->filesScanned, static_cast<std::uint64_t>(std::count_if(sourceListing.begin(),
+            sourceListing.end(), [](const ListingEntry& entry) { return entry.kind == EntryKind::File; })));
+
+        if (!filter.empty()) {
+            auto excluded = [&](const ListingEntry& entry) {
+                return filter.excludes(directory.relative, entry.name, entry.kind == EntryKind::Directory);
+            };
+            if (snapshot != nullptr && !replicaCached) {
+                unfilteredReplica = replicaListing;
+            }
+            sourceListing.erase(std::remove_if(sourceListing.begin(), sourceListing.end(), excluded), sourceListing.end());
+            replicaListing.erase(std::remove_if(replicaListing.begin(), replicaListing.end(), excluded), replicaListing.end());
+        }
+        if (directory.relative.empty()) {
+            for (const auto& name : reservedReplicaNames(options)) {
+                auto reserved = [&name](const ListingEntry& entry) { return entry.name == name; };
+                auto it = std::find_if(sourceListing.begin(), sourceListing.end(), reserved);
+                if (it != sourceListing.end()) {
+                    std::string message = "Source entry has the name of a directory the synchronizer keeps in the replica, not synchronized: "
+                        + fs::path(directory.sourceEntry(name)).string();
+                    logOperation(logFilePath, "Error: " + message);
+                    logEvent(options, { "error", name, -1, -1, {}, message });
+                    CycleStats::add<std::uint64_t>(options.stats->errors, 1);
+                    sourceListing.erase(it);
+                }
+                replicaListing.erase(std::remove_if(replicaListing.begin(), replicaListing.end(), reserved), replicaListing.end());
+            }
+        }
+
+        size_t i = 0;
+        size_t j = 0;
+        while (i < sourceListing.size() || j < replicaListing.size()) {
+            if (j == replicaListing.size() || (i < sourceListing.size() && sourceListing[i].name < replicaListing[j].name)) {
+                // Only in source
+                const auto& entry = sourceListing[i];
+                if (entry.kind == EntryKind::File) {
+                    toCopy.emplace_back(i, std::string::npos);
+                }
+                else if (entry.kind == EntryKind::Directory) {
+                    subdirectories.push_back({ entry.name, true });
+                }
+                if (entry.kind != EntryKind::Other) {
+                    expectedReplica.push_back({ entry.name, entry.kind, true, unknownSize });
+                }
+                ++i;
+            }
+            else if (i == sourceListing.size() || replicaListing[j].name < sourceListing[i].name) {
+                // Only in replica
+                toRemove.push_back(replicaListing[j++].name);
+            }
+            else {
+                // In both; a kind mismatch replaces the replica entry
+                const auto& sourceEntry = sourceListing[i];
+                const auto& replicaEntry = replicaListing[j];
+                bool sameKind = sourceEntry.kind == replicaEntry.kind;
+                if (!sameKind && sourceEntry.kind != EntryKind::Other) {
+                    toRemove.push_back(replicaEntry.name);
+                }
+                if (sourceEntry.kind == EntryKind::File) {
+                    toCopy.emplace_back(i, sameKind ? j : std::string::npos);
+                }
+                else if (sourceEntry.kind == EntryKind::Directory) {
+                    subdirectories.push_back({ sourceEntry.name, !sameKind });
+                }
+                const auto& kept = sourceEntry.kind == EntryKind::Other ? replicaEntry : sourceEntry;
+                expectedReplica.push_back({ kept.name, kept.kind, true, unknownSize });
+                ++i;
+                ++j;
+            }
+        }
+
+        DirectoryChanges changes;
+        for (const auto& name : toRemove) {
+            replicaModified = true;
+            syncDelete(replicaDir, directory.relative, name, logFilePath, options);
+            directories.forget(directory.replicaEntry(name));
+            ++changes.removed;
+        }
+
+        for (const auto& [sourceIndex, replicaIndex] : toCopy) {
+            const auto& sourceEntry = sourceListing[sourceIndex];
+            const ListingEntry* replicaEntry = replicaIndex == std::string::npos ? nullptr : &replicaListing[replicaIndex];
+            if (syncCopy(sourceDir, replicaDir, directory.relative, sourceEntry, replicaEntry, logFilePath, options)) {
+                replicaModified = true;
+                ++changes.copied;
+            }
+        }
+
+        for (const auto& subdirectory : subdirectories) {
+            if (subdirectory.create) {
+                // Create directory in replica if it does not exist
+                replicaModified = true;
+                makeDirectoryAt(replicaDir, subdirectory.name);
+                logEvent(options, { "mkdir", TreePath::join(directory.relative, subdirectory.name), -1, -1, {}, {} });
+                CycleStats::add<std::uint64_t>(options.stats->directoriesCreated, 1);
+                ++changes.created;
+                if (options.verbosity == Verbosity::File) {
+                    logOperation(logFilePath, "Created directory: " + fs::path(directory.replicaEntry(subdirectory.name)).string());
+                }
+                options.stats->changesMade = true;  // Flag changes
+            }
+        }
+        if (options.verbosity == Verbosity::Directory) {
+            changes.log(directory.replica, logFilePath);
+        }
+
+        if (snapshot != nullptr && !replicaCached) {
+            // A modified directory gets the listing it should now have, so that its subdirectories
+            // keep their ids, but it is invalidated below and listed again next cycle
+            const auto& listed = filter.empty() ? replicaListing : unfilteredReplica;
+            snapshot->replica.store(task.replicaNode, replicaStamp, replicaModified ? expectedReplica : listed, directory.relative);
+        }
+    }
+    catch (const fs::filesystem_error& e) {
+        logOperation(logFilePath, "Filesystem error: " + std::string(e.what()));
+        logEvent(options, { "error", directory.relative, -1, -1, {}, e.what() });
+        CycleStats::add<std::uint64_t>(options.stats->errors, 1);
+        failed = true;
+    }
+    catch (const std::exception& e) {
+        logOperation(logFilePath, "Error: " + std::string(e.what()));
+        logEvent(options, { "error", directory.relative, -1, -1, {}, e.what() });
+        CycleStats::add<std::uint64_t>(options.stats->errors, 1);
+        failed = true;
+    }
+    if ((replicaModified || failed) && snapshot != nullptr) {
+        snapshot->replica.invalidate(task.replicaNode);
+    }
+    if (failed) {
+        return;
+    }
+
+    for (const auto& subdirectory : subdirectories) {
+        auto it = std::lower_bound(sourceListing.begin(), sourceListing.end(), subdirectory.name,
+            [](const ListingEntry& entry, const fs::path::string_type& name) { return entry.name < name; });
+        if (it != sourceListing.end() && it->descend) {
+            WalkTask child{ directory.child(subdirectory.name), subdirectory.create, TreeSnapshot::none, TreeSnapshot::none };
+            if (snapshot != nullptr) {
+                child.sourceNode = snapshot->source.child(task.sourceNode, subdirectory.name);
+                child.replicaNode = snapshot->replica.child(task.replicaNode, subdirectory.name);
+            }
+            children.push_back(std::move(child));
+        }
+    }
+}
+
+/**
+ * brief Walker threads shared by the cycles of every pair
+ *
+ * Each cycle walks on its own thread plus the extra threads it gets here, so however many
+ * pairs run at once, no more extra walkers exist than the budget holds. A cycle that gets
+ * none walks on its own thread alone.
+ */
+class WalkerBudget {
+public:
+    /**
+     * brief Create a budget
+     * param extra Extra walker threads shared by all cycles
+     */
+    explicit WalkerBudget(unsigned extra) : available(extra) {}
+
+    /**
+     * brief Take up to wanted threads from the budget
+     * return Number of threads granted, possibly 0
+     */
+    unsigned acquire(unsigned wanted) {
+        std::lock_guard<std::mutex> guard(mutex);
+        unsigned granted = std::min(wanted, available);
+        available -= granted;
+        return granted;
+    }
+
+    /**
+     * brief Give back threads taken with acquire()
+     */
+    void release(unsigned count) {
+        std::lock_guard<std::mutex> guard(mutex);
+        available += count;
+    }
+
+private:
+    std::mutex mutex;
+    unsigned available;
+};
+
+/**
+ * brief Parallel tree walker over directory pairs
+ *
+ * Each worker owns a deque: it pushes the subdirectories it finds and pops from the back
+ * (depth-first, like the serial walk), while idle workers steal from the front of other
+ * workers' deques, which holds the largest unexplored subtrees. Listing and stat latency of
+ * different directories therefore overlaps. With a single thread the walk runs in the calling
+ * thread and visits pairs in exactly the serial depth-first order.
+ */
+class ParallelWalker {
+public:
+    using Visit = std::function<void(const WalkTask&, std::vector<WalkTask>&)>;
+
+    /**
+     * brief Create a walker
+     * param threads Number of worker threads (at least one)
+     * param visit Called once per directory pair; fills the vector with the pairs to descend into
+     * param depth Gauge following the number of directories queued or being visited, if any
+     */
+    ParallelWalker(unsigned threads, Visit visit, std::atomic<std::int64_t>* depth = nullptr)
+        : visit(std::move(visit)), depth(depth) {
+        for (unsigned i = 0; i < std::max(threads, 1u); ++i) {
+            queues.push_back(std::make_unique<WorkerQueue>());
+        }
+    }
+
+    /**
+     * brief Walk the tree below root; returns once every pair has been visited
+     * param root Root directory pair
+     */
+    void run(WalkTask root) {
+        pending = 1;
+        track(1);
+        queues[0]->tasks.push_back(std::move(root));
+        queued = 1;
+        std::vector<std::thread> workers;
+        for (size_t i = 1; i < queues.size(); ++i) {
+            workers.emplace_back(&ParallelWalker::work, this, i);
+        }
+        work(0);
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+private:
+    struct WorkerQueue {
+        std::mutex mutex;
+        std::deque<WalkTask> tasks;
+    };
+
+    /**
+     * brief Take a task from the worker's own deque, or steal one from another worker
+     */
+    bool takeTask(size_t self, WalkTask& task) {
+        {
+            auto& own = *queues[self];
+            std::lock_guard<std::mutex> guard(own.mutex);
+            if (!own.tasks.empty()) {
+                task = std::move(own.tasks.back());
+                own.tasks.pop_back();
+                --queued;
+                return true;
+            }
+        }
+        for (size_t offset = 1; offset < queues.size(); ++offset) {
+            auto& victim = *queues[(self + offset) % queues.size()];
+            std::lock_guard<std::mutex> guard(victim.mutex);
+            if (!victim.tasks.empty()) {
+                task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                --queued;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * brief Worker loop: run tasks until no task is queued or in progress anywhere
+     */
+    void work(size_t self) {
+        std::vector<WalkTask> children;
+        WalkTask task;
+        while (pending > 0) {
+            if (!takeTask(self, task)) {
+                std::unique_lock<std::mutex> lock(idleMutex);
+                idle.wait(lock, [this] { return pending == 0 || queued > 0; });
+                continue;
+            }
+
+            children.clear();
+            visit(task, children);
+            if (!children.empty()) {
+                pending += children.size();
+                track(static_cast<std::int64_t>(children.size()));
+                {
+                    // Pushed in reverse so that popping from the back yields name order
+                    auto& own = *queues[self];
+                    std::lock_guard<std::mutex> guard(own.mutex);
+                    for (auto it = children.rbegin(); it != children.rend(); ++it) {
+                        own.tasks.push_back(std::move(*it));
+                    }
+                    // Counted before the deque is released, so a thief never takes a task not yet counted
+                    queued += children.size();
+                }
+                wakeIdle();
+            }
+            track(-1);
+            if (--pending == 0) {
+                wakeIdle();
+            }
+        }
+    }
+
+    /**
+     * brief Wake the idle workers after queued or pending changed
+     *
+     * Taking idleMutex first orders the change before any waiter's predicate check, so a
+     * worker about to wait cannot miss it.
+     */
+    void wakeIdle() {
+        {
+            std::lock_guard<std::mutex> guard(idleMutex);
+        }
+        idle.notify_all();
+    }
+
+    void track(std::int64_t change) {
+        if (depth != nullptr) {
+            depth->fetch_add(change, std::memory_order_relaxed);
+        }
+    }
+
+    Visit visit;
+    std::vector<std::unique_ptr<WorkerQueue>> queues;
+    std::atomic<size_t> pending{ 0 };  ///< Tasks queued or being visited
+    std::atomic<size_t> queued{ 0 };   ///< Tasks waiting in some worker's deque
+    std::atomic<std::int64_t>* depth;  ///< Mirrors pending for the metrics exporter, if set
+    std::mutex idleMutex;
+    std::condition_variable idle;      ///< Wakes idle workers when work appears or the walk ends
+};
+
+/**
+ * brief Order relative paths the way a depth-first walk with sorted names visits them
+ *
+ * Separators compare lower than any other character, so a directory sorts right before its
+ * own descendants and they all sort before its next sibling.
+ */
+bool walkOrderLess(const fs::path::string_type& a, const fs::path::string_type& b) {
+    auto key = [](fs::path::value_type c) {
+        using Unsigned = std::make_unsigned_t<fs::path::value_type>;
+        return c == fs::path::preferred_separator || c == '/' ? 0u : static_cast<unsigned>(static_cast<Unsigned>(c)) + 1u;
+    };
+    return std::lexicographical_compare(a.begin(), a.end(), b.begin(), b.end(),
+        [&](fs::path::value_type x, fs::path::value_type y) { return key(x) < key(y); });
+}
+
+/**
+ * brief Walk directory pairs from a root task with the parallel walker
+ *
+ * In deterministic order mode each directory pair's log entries are held back and written,
+ * sorted by walk order, once the walk completes, so the log matches a serial run.
+ * param root Directory pair to start from
+ * param descendExisting False to only descend into subdirectories the walk itself created
+ * param logFilePath Path to the log file
+ * param options Walk options
+ * param snapshot Tree snapshots carried across cycles, or nullptr to always read listings
+ */
+void walkPairs(const WalkTask& root, bool descendExisting, const std::string& logFilePath, const SyncOptions& options,
+    PairSnapshot* snapshot) {
+    unsigned threads = std::max(options.threads, 1u);
+    if (options.walkers != nullptr) {
+        threads = 1 + options.walkers->acquire(threads - 1);
+    }
+    bool capture = options.deterministicOrder && threads > 1;
+    std::mutex capturedMutex;
+    std::vector<std::pair<fs::path::string_type, std::vector<std::string>>> captured;
+
+    DirectoryCache directories;
+    ParallelWalker walker(threads, [&](const WalkTask& task, std::vector<WalkTask>& children) {
+        std::vector<std::string> entries;
+        if (capture) {
+            capturedLog = &entries;
+        }
+        syncDirectoryPair(task, directories, snapshot, options, logFilePath, children);
+        capturedLog = nullptr;
+        if (!descendExisting) {
+            children.erase(std::remove_if(children.begin(), children.end(), [](const WalkTask& child) { return !child.replicaIsNew; }),
+                children.end());
+        }
+        if (!entries.empty()) {
+            std::lock_guard<std::mutex> guard(capturedMutex);
+            captured.emplace_back(task.path.relative, std::move(entries));
+        }
+    }, &options.stats->walkQueue);
+    walker.run(root);
+    if (options.walkers != nullptr) {
+        options.walkers->release(threads - 1);
+    }
+
+    std::sort(captured.begin(), captured.end(), [](const auto& a, const auto& b) {
+        return walkOrderLess(a.first, b.first);
+    });
+    for (const auto& [relative, entries] : captured) {
+        for (const auto& entry : entries) {
+            writeLogEntry(logFilePath, entry);
+        }
+    }
+}
+
+/**
+ * brief Compact both snapshots and report the source change set of the cycle
+ *
+ * The change set is counted in the cycle's statistics, so that it reaches the report, and
+ * each path in it goes to the event log.
+ * param snapshot Tree snapshots, or nullptr
+ * param logFilePath Path to the log file, or empty to skip the summary line
+ * param options Counters and event log of the pair
+ */
+void finishSnapshotCycle(PairSnapshot* snapshot, const std::string& logFilePath, const SyncOptions& options) {
+    if (snapshot == nullptr) {
+        return;
+    }
+    snapshot->source.compact();
+    snapshot->replica.compact();
+    ChangeSet changes = snapshot->source.takeChanges();
+    CycleStats::add<std::uint64_t>(options.stats->sourceAdded, changes.added.size());
+    CycleStats::add<std::uint64_t>(options.stats->sourceRemoved, changes.removed.size());
+    for (const auto& path : changes.added) {
+        logEvent(options, { "appeared", path, -1, -1, {}, {} });
+    }
+    for (const auto& path : changes.removed) {
+        logEvent(options, { "vanished", path, -1, -1, {}, {} });
+    }
+    if (!logFilePath.empty() && (!changes.added.empty() || !changes.removed.empty())) {
+        logOperation(logFilePath, "Source changes since last cycle: " + std::to_string(changes.added.size()) + " added, "
+            + std::to_string(changes.removed.size()) + " removed");
+    }
+}
+
+/**
+ * brief Main synchronization function that walks the source and replica trees together
+ * param source Source directory path
+ * param replica Replica directory path
+ * param logFilePath Path to the log file
+ * param options Walk options
+ * param snapshot Tree snapshots carried across cycles, or nullptr to always read listings
+ */
+void syncFolders(const fs::path& source, const fs::path& replica, const std::string& logFilePath, const SyncOptions& options,
+    PairSnapshot* snapshot) {
+    options.stats->changesMade = false;  // Reset changes flag at the beginning of synchronization
+    if (options.trash != nullptr) {
+        options.trash->beginCycle();
+    }
+    try {
+        bool replicaIsNew = false;
+
+        // Ensure replica exists
+        if (!fs::exists(replica)) {
+            fs::create_directory(replica);
+            logOperation(logFilePath, "Created replica directory: " + replica.string());
+            options.stats->changesMade = true;  // Flag changes
+            replicaIsNew = true;
+        }
+
+        // Sync subdirectories, copies and deletions in one merge-join pass
+        walkPairs({ { source.native(), replica.native(), {} }, replicaIsNew }, true, logFilePath, options, snapshot);
+        finishSnapshotCycle(snapshot, logFilePath, options);
+#ifdef __linux__
+        if (options.deletions != nullptr) {
+            options.deletions->reportProgress();
+        }
+#endif
+    }
+    catch (const fs::filesystem_error& e) {
+        logOperation(logFilePath, "Filesystem error: " + std::string(e.what()));
+        CycleStats::add<std::uint64_t>(options.stats->errors, 1);
+    }
+    catch (const std::exception& e) {
+        logOperation(logFilePath, "Error: " + std::string(e.what()));
+        CycleStats::add<std::uint64_t>(options.stats->errors, 1);
+    }
+}
+
+/**
+ * brief A source path reported as changed by a change detector
+ */
+struct ChangedPath {
+    fs::path::string_type relative;  ///< Path relative to the source root
+    bool rescan = false;             ///< The path is a directory whose own listing must be synchronized too
+};
+
+/**
+ * brief Synchronize only the given source paths, in time proportional to the number of changes
+ *
+ * Each path is compared with its replica counterpart and only the operations it needs are
+ * applied: a path gone from the source is removed from the replica with everything below it,
+ * a file is copied if it differs, and a directory is created. Missing replica ancestors are
+ * created on the way; since their other contents cannot have been reported yet, a directory
+ * created here is filled by a full walk of its source counterpart. Existing directories are
+ * only re-listed when a change asks for a rescan. Paths below one that was removed or walked
+ * in full are skipped, and so are excluded paths and everything below them.
+ * param source Source directory path
+ * param replica Replica directory path
+ * param changes Changed paths, in any order and possibly with repeats
+ * param logFilePath Path to the log file
+ * param options Walk options
+ * param snapshot Tree snapshots carried across cycles, or nullptr to always read listings
+ */
+void syncPaths(const fs::path& source, const fs::path& replica, std::vector<ChangedPath> changes, const std::string& logFilePath,
+    const SyncOptions& options, PairSnapshot* snapshot) {
+    if (options.trash != nullptr) {
+        options.trash->beginCycle();
+    }
+    // Parents come first and the descendants of a path follow it directly
+    std::sort(changes.begin(), changes.end(), [](const ChangedPath& a, const ChangedPath& b) {
+        return walkOrderLess(a.relative, b.relative);
+    });
+
+    auto walk = [&](const TreePath& path, bool replicaIsNew) {
+        WalkTask task{ path, replicaIsNew };
+        if (snapshot != nullptr) {
+            task.sourceNode = snapshot->source.resolve(path.relative);
+            task.replicaNode = snapshot->replica.resolve(path.relative);
+        }
+        walkPairs(task, replicaIsNew, logFilePath, options, snapshot);
+    };
+    DirectoryCache directories;
+    std::map<fs::path::string_type, DirectoryChanges> touched;  ///< Changes per replica directory, for the directory-level log
+    auto createDirectory = [&](const DirHandle& replicaDir, const TreePath& path, const fs::path::string_type& name) {
+        makeDirectoryAt(replicaDir, name);
+        logEvent(options, { "mkdir", TreePath::join(path.relative, name), -1, -1, {}, {} });
+        CycleStats::add<std::uint64_t>(options.stats->directoriesCreated, 1);
+        ++touched[path.replica].created;
+        if (options.verbosity == Verbosity::File) {
+            logOperation(logFilePath, "Created directory: " + fs::path(path.replicaEntry(name)).string());
+        }
+        options.stats->changesMade = true;  // Flag changes
+    };
+    auto remove = [&](const DirHandle& replicaDir, const TreePath& path, const fs::path::string_type& name) {
+        syncDelete(replicaDir, path.relative, name, logFilePath, options);
+        directories.forget(path.replicaEntry(name));
+        ++touched[path.replica].removed;
+    };
+    // Left to the full scans, which report a source entry of a reserved name
+    auto reservedNames = reservedReplicaNames(options);
+    auto reserved = [&reservedNames](const TreePath& path, const fs::path::string_type& name) {
+        return path.relative.empty() && std::find(reservedNames.begin(), reservedNames.end(), name) != reservedNames.end();
+    };
+    auto below = [](const fs::path::string_type& relative, const fs::path::string_type& ancestor) {
+        return relative.size() > ancestor.size() && relative.compare(0, ancestor.size(), ancestor) == 0
+            && (relative[ancestor.size()] == '/' || relative[ancestor.size()] == fs::path::preferred_separator);
+    };
+
+    std::optional<fs::path::string_type> covered;  ///< Last path handled together with everything below it
+    for (size_t c = 0; c < changes.size(); ++c) {
+        const auto& change = changes[c];
+        if ((c > 0 && changes[c - 1].relative == change.relative && changes[c - 1].rescan == change.rescan)
+            || (covered && (*covered == change.relative || below(change.relative, *covered)))) {
+            continue;
+        }
+        try {
+            TreePath path{ source.native(), replica.native(), {} };
+            if (change.relative.empty()) {
+                walk(path, false);
+                continue;
+            }
+
+            // Go down to the parent of the changed path, creating missing replica directories
+            DirHandle sourceDir = directories.open(path.source);
+            DirHandle replicaDir = directories.open(path.replica);
+            bool done = false;
+            size_t start = 0;
+            size_t end = change.relative.find_first_of(TreeSnapshot::separators);
+            for (; end != fs::path::string_type::npos; start = end + 1, end = change.relative.find_first_of(TreeSnapshot::separators, start)) {
+                fs::path::string_type name = change.relative.substr(start, end - start);
+                if (options.filter.excludes(path.relative, name, true) || reserved(path, name)) {
+                    covered = change.relative.substr(0, end);
+                    done = true;
+                    break;
+                }
+                ListingEntry sourceEntry;
+                ListingEntry replicaEntry;
+                bool inReplica = readEntry(replicaDir, name, replicaEntry);
+                if (!readEntry(sourceDir, name, sourceEntry) || sourceEntry.kind != EntryKind::Directory || !sourceEntry.descend) {
+                    // The change is stale; an ancestor gone from the source goes from the replica too
+                    if (inReplica && !readEntry(sourceDir, name, sourceEntry)) {
+                        remove(replicaDir, path, name);
+                    }
+                    covered = change.relative.substr(0, end);
+                    done = true;
+                    break;
+                }
+                if (inReplica && replicaEntry.kind != EntryKind::Directory) {
+                    remove(replicaDir, path, name);
+                    inReplica = false;
+                }
+                if (!inReplica) {
+                    createDirectory(replicaDir, path, name);
+                    walk(path.child(name), true);
+                    covered = change.relative.substr(0, end);
+                    done = true;
+                    break;
+                }
+                path = path.child(name);
+                sourceDir = directories.open(path.source);
+                replicaDir = directories.open(path.replica);
+            }
+            if (done) {
+                continue;
+            }
+
+            fs::path::string_type name = change.relative.substr(start);
+            ListingEntry sourceEntry;
+            ListingEntry replicaEntry;
+            bool inSource = readEntry(sourceDir, name, sourceEntry);
+            bool inReplica = readEntry(replicaDir, name, replicaEntry);
+            EntryKind kind = inSource ? sourceEntry.kind : replicaEntry.kind;
+            if ((inSource || inReplica) && (options.filter.excludes(path.relative, name, kind == EntryKind::Directory) || reserved(path, name))) {
+                covered = change.relative;
+                continue;
+            }
+            if (!inSource || sourceEntry.kind == EntryKind::Other) {
+                if (!inSource && inReplica) {
+                    remove(replicaDir, path, name);
+                }
+                covered = change.relative;
+                continue;
+            }
+            if (inReplica && replicaEntry.kind != sourceEntry.kind) {
+                remove(replicaDir, path, name);
+                inReplica = false;
+            }
+            if (sourceEntry.kind == EntryKind::File) {
+                CycleStats::add<std::uint64_t>(options.stats->filesScanned, 1);
+                if (syncCopy(sourceDir, replicaDir, path.relative, sourceEntry, inReplica ? &replicaEntry : nullptr, logFilePath, options)) {
+                    ++touched[path.replica].copied;
+                }
+            }
+            else if (!inReplica) {
+                createDirectory(replicaDir, path, name);
+                if (sourceEntry.descend) {
+                    walk(path.child(name), true);
+                }
+                covered = change.relative;
+            }
+            else if (change.rescan && sourceEntry.descend) {
+                walk(path.child(name), false);
+            }
+        }
+        catch (const fs::filesystem_error& e) {
+            logOperation(logFilePath, "Filesystem error: " + std::string(e.what()));
+            logEvent(options, { "error", change.relative, -1, -1, {}, e.what() });
+            CycleStats::add<std::uint64_t>(options.stats->errors, 1);
+        }
+        catch (const std::exception& e) {
+            logOperation(logFilePath, "Error: " + std::string(e.what()));
+            logEvent(options, { "error", change.relative, -1, -1, {}, e.what() });
+            CycleStats::add<std::uint64_t>(options.stats->errors, 1);
+        }
+    }
+    if (options.verbosity == Verbosity::Directory) {
+        for (const auto& [directory, directoryChanges] : touched) {
+            directoryChanges.log(directory, logFilePath);
+        }
+    }
+    // Each entry was already logged as it was synchronized
+    finishSnapshotCycle(snapshot, {}, options);
+}
+
+/**
+ * brief Merges change events per path and releases a path once it has settled
+ *
+ * A path is released when no event arrived for it during the quiet period, or at the latest
+ * once the maximum staleness has passed since its first pending event, so that a file which
+ * is written continuously is still replicated at a bounded rate instead of on every write.
+ */
+class ChangeCoalescer {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    ChangeCoalescer(Clock::duration quietPeriod, Clock::duration maxStaleness) : quietPeriod(quietPeriod), maxStaleness(maxStaleness) {}
+
+    /**
+     * brief Record an event for a path
+     * param change The changed path
+     * param now Time the event was seen
+     */
+    void add(const ChangedPath& change, Clock::time_point now) {
+        auto [it, inserted] = pending.try_emplace(change.relative, Pending{ now, now, change.rescan });
+        if (!inserted) {
+            it->second.last = now;
+            it->second.rescan = it->second.rescan || change.rescan;
+        }
+    }
+
+    /**
+     * brief Remove and return the paths that are due
+     * param now Current time
+     * return Paths that went quiet or reached the staleness bound
+     */
+    std::vector<ChangedPath> takeReady(Clock::time_point now) {
+        std::vector<ChangedPath> ready;
+        for (auto it = pending.begin(); it != pending.end();) {
+            if (now >= due(it->second)) {
+                ready.push_back({ it->first, it->second.rescan });
+                it = pending.erase(it);
+            }
+            else {
+                ++it;
+            }
+        }
+        return ready;
+    }
+
+    /**
+     * brief Earliest time at which a pending path becomes due
+     * return That time, or Clock::time_point::max() if nothing is pending
+     */
+    Clock::time_point nextDeadline() const {
+        Clock::time_point next = Clock::time_point::max();
+        for (const auto& [relative, entry] : pending) {
+            next = std::min(next, due(entry));
+        }
+        return next;
+    }
+
+    /**
+     * brief Number of paths waiting to settle
+     */
+    size_t size() const {
+        return pending.size();
+    }
+
+    /**
+     * brief Drop every pending path, e.g. after a full scan covered them
+     */
+    void clear() {
+        pending.clear();
+    }
+
+private:
+    struct Pending {
+        Clock::time_point first;  ///< First event since the path was last released
+        Clock::time_point last;   ///< Most recent event
+        bool rescan;
+    };
+
+    Clock::time_point due(const Pending& entry) const {
+        return std::min(entry.last + quietPeriod, entry.first + maxStaleness);
+    }
+
+    Clock::duration quietPeriod;
+    Clock::duration maxStaleness;
+    std::unordered_map<fs::path::string_type, Pending> pending;
+};
+
+#ifdef __linux__
+/**
+ * brief Recursive inotify watch on the source tree that collects the paths that changed
+ *
+ * Every source directory gets its own watch. Directories created or moved into the tree are
+ * registered as soon as their creation is seen, and reported for a rescan together with every
+ * directory found inside them, since entries may have appeared before the watch was in place.
+ * Excluded directories are not watched, and events for excluded entries are dropped. A queue
+ * overflow (or running out of watches) is reported so the caller can fall back to a full scan.
+ */
+class SourceWatcher {
+public:
+    SourceWatcher(const fs::path& root, const PathFilter& filter) : root(root.native()), filter(filter) {}
+
+    ~SourceWatcher() {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    SourceWatcher(const SourceWatcher&) = delete;
+    SourceWatcher& operator=(const SourceWatcher&) = delete;
+
+    /**
+     * brief Create the inotify instance and watch the whole source tree
+     * return False if inotify is unavailable
+     */
+    bool start() {
+        fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (fd < 0) {
+            return false;
+        }
+        watchTree({}, nullptr);
+        return true;
+    }
+
+    /**
+     * brief Wait for events and collect the paths they concern
+     * param timeout Longest time to wait for the first event
+     * param changes Receives the changed paths, possibly with repeats
+     * return False if events were lost and a full scan is needed
+     */
+    bool collect(std::chrono::milliseconds timeout, std::vector<ChangedPath>& changes) {
+        pollfd descriptor{ fd, POLLIN, 0 };
+        if (poll(&descriptor, 1, static_cast<int>(timeout.count())) <= 0) {
+            return takeOverflow();
+        }
+
+        alignas(inotify_event) char buffer[64 * 1024];
+        for (;;) {
+            ssize_t bytes = read(fd, buffer, sizeof(buffer));
+            if (bytes <= 0) {
+                break;
+            }
+            for (ssize_t offset = 0; offset < bytes;) {
+                auto* event = reinterpret_cast<inotify_event*>(buffer + offset);
+                offset += sizeof(inotify_event) + event->len;
+                if (event->mask & IN_Q_OVERFLOW) {
+                    overflowed = true;
+                    continue;
+                }
+                auto it = paths.find(event->wd);
+                if (it == paths.end()) {
+                    continue;
+                }
+                if (event->mask & IN_IGNORED) {
+                    paths.erase(it);
+                    continue;
+                }
+                if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+                    continue;  // Reported to the parent as well
+                }
+                const fs::path::string_type& directory = it->second;
+                if (event->len == 0) {
+                    changes.push_back({ directory, true });
+                    continue;
+                }
+                if (filter.excludes(directory, event->name, event->mask & IN_ISDIR)) {
+                    continue;
+                }
+                fs::path::string_type relative = directory.empty() ? fs::path::string_type(event->name) : TreePath::join(directory, event->name);
+                if ((event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO))) {
+                    watchTree(relative, &changes);
+                }
+                else {
+                    changes.push_back({ std::move(relative), false });
+                }
+            }
+        }
+        return takeOverflow();
+    }
+
+private:
+    static constexpr std::uint32_t eventMask = IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO
+        | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+
+    /**
+     * brief Watch a directory and everything below it
+     * param relative Relative path of the directory
+     * param changes If set, receives every directory registered, to be rescanned
+     */
+    void watchTree(const fs::path::string_type& relative, std::vector<ChangedPath>* changes) {
+        std::vector<fs::path::string_type> pending{ relative };
+        while (!pending.empty()) {
+            fs::path::string_type current = std::move(pending.back());
+            pending.pop_back();
+            fs::path::string_type absolute = current.empty() ? root : TreePath::join(root, current);
+
+            // The watch goes in before the listing so that nothing created in between is missed
+            int wd = inotify_add_watch(fd, absolute.c_str(), eventMask);
+            if (wd < 0) {
+                if (errno == ENOSPC || errno == ENOMEM) {
+                    overflowed = true;
+                }
+                continue;
+            }
+            paths[wd] = current;
+            if (changes != nullptr) {
+                changes->push_back({ current, true });
+            }
+
+            int dirFd = ::open(absolute.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (dirFd < 0) {
+                continue;
+            }
+            try {
+                for (const auto& entry : readListing({ absolute, std::make_shared<FileDescriptor>(dirFd) })) {
+                    if (entry.kind == EntryKind::Directory && entry.descend && !filter.excludes(current, entry.name, true)) {
+                        pending.push_back(current.empty() ? entry.name : TreePath::join(current, entry.name));
+                    }
+                }
+            }
+            catch (const fs::filesystem_error&) {
+                // Vanished while being registered; its parent reports the removal
+            }
+        }
+    }
+
+    bool takeOverflow() {
+        bool ok = !overflowed;
+        overflowed = false;
+        return ok;
+    }
+
+    fs::path::string_type root;
+    const PathFilter& filter;
+    int fd = -1;
+    std::unordered_map<int, fs::path::string_type> paths;  ///< Watch descriptor to relative directory path
+    bool overflowed = false;
+};
+#endif
+
+/**
+ * brief Prometheus exposition of the counters of every pair
+ *
+ * Nothing is computed on the synchronization path beyond the per-thread counters of
+ * CycleStats; the exposition is built from them whenever it is asked for. It is written to a
+ * file in the node_exporter textfile format after every cycle, served over HTTP at /metrics,
+ * or both.
+ */
+class MetricsExporter {
+public:
+    explicit MetricsExporter(const std::string& logFilePath) : logFilePath(logFilePath), started(std::chrono::system_clock::now()) {}
+
+    ~MetricsExporter() {
+#ifdef __linux__
+        if (server.joinable()) {
+            stopping = true;
+            char byte = 0;
+            (void)!write(pipeFds[1], &byte, 1);
+            server.join();
+        }
+        for (int fd : { listenFd, pipeFds[0], pipeFds[1] }) {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+#endif
+    }
+
+    MetricsExporter(const MetricsExporter&) = delete;
+    MetricsExporter& operator=(const MetricsExporter&) = delete;
+
+    /**
+     * brief Export a pair; pairs must be added before serving starts
+     * param label Value of the pair label
+     * param stats Counters of the pair
+     * param deletions Background deletion engine of the pair, if any
+     */
+    void addPair(const std::string& label, const CycleStats* stats, const DeletionEngine* deletions) {
+        pairs.push_back({ escape(label), stats, deletions });
+    }
+
+    /**
+     * brief Export the backlog of a log writer
+     * param label Value of the log label
+     * param logger The writer
+     */
+    void addLog(const std::string& label, const AsyncLogger* logger) {
+        logs.emplace_back(escape(label), logger);
+    }
+
+    /**
+     * brief Rewrite the metrics file at the end of every cycle
+     * param path Path of the file; it should end in .prom for node_exporter to pick it up
+     */
+    void setFile(const fs::path& path) {
+        file = path;
+    }
+
+    /**
+     * brief Called when a cycle of any pair has finished
+     */
+    void cycleFinished() {
+        if (file.empty()) {
+            return;
+        }
+        std::string text = render();
+        // Written aside and renamed, so that the collector never reads a partial file
+        std::lock_guard<std::mutex> guard(fileMutex);
+        fs::path temporary = file;
+        temporary += ".tmp";
+        std::error_code error;
+        {
+            std::ofstream output(temporary, std::ios::trunc);
+            output << text;
+            if (!output.good()) {
+                error = std::make_error_code(std::errc::io_error);
+            }
+        }
+        if (!error) {
+            fs::rename(temporary, file, error);
+        }
+        if (error && !reportedFileError) {
+            logOperation(logFilePath, "Error: Unable to write metrics file: " + file.string());
+            reportedFileError = true;
+        }
+    }
+
+    /**
+     * brief Build the exposition text
+     */
+    std::string render() const {
+        std::vector<CycleStats::Totals> totals;
+        for (const auto& pair : pairs) {
+            totals.push_back(pair.stats->snapshot());
+        }
+        auto now = std::chrono::system_clock::now();
+        auto unixSeconds = [](std::int64_t milliseconds) { return static_cast<double>(milliseconds) / 1000; };
+
+        std::ostringstream out;
+        out << std::setprecision(15);
+        auto header = [&out](const char* name, const char* type, const char* help) {
+            out << "# HELP " << name << ' ' << help << '\n' << "# TYPE " << name << ' ' << type << '\n';
+        };
+        // One sample per pair, with the value taken from its totals (and, for gauges, its live counters)
+        auto perPair = [&](const char* name, const char* type, const char* help, const auto& value) {
+            header(name, type, help);
+            for (size_t i = 0; i < pairs.size(); ++i) {
+                out << name << "{pair=\"" << pairs[i].label << "\"} " << value(totals[i], *pairs[i].stats) << '\n';
+            }
+        };
+        auto histogram = [&out](const std::string& name, const std::string& labels, const Histogram& values) {
+            std::uint64_t cumulative = 0;
+            for (size_t b = 0; b < values.buckets.size(); ++b) {
+                cumulative += values.buckets[b];
+                out << name << "_bucket{" << labels << ",le=\"";
+                if (b < Histogram::bounds.size()) {
+                    out << Histogram::bounds[b];
+                }
+                else {
+                    out << "+Inf";
+                }
+                out << "\"} " << cumulative << '\n';
+            }
+            out << name << "_sum{" << labels << "} " << values.sum << '\n' << name << "_count{" << labels << "} " << values.count << '\n';
+        };
+        using Totals = CycleStats::Totals;
+
+        perPair("syncfolders_cycles_total", "counter", "Cycles finished, watch mode batches included.",
+            [](const Totals& t, const CycleStats&) { return t.cycles; });
+        perPair("syncfolders_directories_scanned_total", "counter", "Directory pairs visited.",
+            [](const Totals& t, const CycleStats&) { return t.directoriesScanned; });
+        perPair("syncfolders_files_scanned_total", "counter", "Source files examined.",
+            [](const Totals& t, const CycleStats&) { return t.filesScanned; });
+        perPair("syncfolders_files_hashed_total", "counter", "Files hashed, counting both sides of a compared pair.",
+            [](const Totals& t, const CycleStats&) { return t.filesHashed; });
+        perPair("syncfolders_hashed_bytes_total", "counter", "Bytes hashed.",
+            [](const Totals& t, const CycleStats&) { return t.bytesHashed; });
+        perPair("syncfolders_files_copied_total", "counter", "Files copied to the replica.",
+            [](const Totals& t, const CycleStats&) { return t.filesCopied; });
+        perPair("syncfolders_copied_bytes_total", "counter", "Bytes copied to the replica.",
+            [](const Totals& t, const CycleStats&) { return t.bytesCopied; });
+        perPair("syncfolders_entries_removed_total", "counter", "Replica entries removed, a directory counting once.",
+            [](const Totals& t, const CycleStats&) { return t.entriesRemoved; });
+        perPair("syncfolders_directories_created_total", "counter", "Replica directories created.",
+            [](const Totals& t, const CycleStats&) { return t.directoriesCreated; });
+        perPair("syncfolders_errors_total", "counter", "Entries or directories that could not be synchronized.",
+            [](const Totals& t, const CycleStats&) { return t.errors; });
+        perPair("syncfolders_overruns_total", "counter", "Cycles that ran past the start of the next one.",
+            [](const Totals&, const CycleStats& s) { return s.overruns.load(); });
+        perPair("syncfolders_missed_ticks_total", "counter", "Scheduled cycles that were skipped after an overrun.",
+            [](const Totals&, const CycleStats& s) { return s.missedTicks.load(); });
+
+        header("syncfolders_phase_seconds_total", "counter", "Time spent per phase, summed over walker threads.");
+        for (size_t i = 0; i < pairs.size(); ++i) {
+            for (size_t phase = 0; phase < CycleStats::phaseNames.size(); ++phase) {
+                out << "syncfolders_phase_seconds_total{pair=\"" << pairs[i].label << "\",phase=\"" << CycleStats::phaseNames[phase] << "\"} "
+                    << static_cast<double>(totals[i].phaseNs[phase]) / 1e9 << '\n';
+            }
+        }
+        header("syncfolders_cycle_duration_seconds", "histogram", "Wall time of each cycle.");
+        for (size_t i = 0; i < pairs.size(); ++i) {
+            histogram("syncfolders_cycle_duration_seconds", "pair=\"" + pairs[i].label + "\"", totals[i].cycleSeconds);
+        }
+        header("syncfolders_phase_duration_seconds", "histogram", "Time of each phase per cycle, summed over walker threads.");
+        for (size_t i = 0; i < pairs.size(); ++i) {
+            for (size_t phase = 0; phase < CycleStats::phaseNames.size(); ++phase) {
+                histogram("syncfolders_phase_duration_seconds",
+                    "pair=\"" + pairs[i].label + "\",phase=\"" + CycleStats::phaseNames[phase] + "\"", totals[i].phaseSeconds[phase]);
+            }
+        }
+
+        perPair("syncfolders_files_per_second", "gauge", "Source files examined per second of wall time in the last cycle.",
+            [](const Totals& t, const CycleStats&) { return t.lastFilesPerSecond; });
+        perPair("syncfolders_interval_seconds", "gauge", "Interval the next cycle is scheduled with.",
+            [](const Totals&, const CycleStats& s) { return static_cast<double>(s.intervalMs.load()) / 1000; });
+        perPair("syncfolders_last_cycle_timestamp_seconds", "gauge", "Unix time the last cycle finished.",
+            [&](const Totals& t, const CycleStats&) { return unixSeconds(t.lastCycleMs); });
+        perPair("syncfolders_last_sync_timestamp_seconds", "gauge", "Unix time a cycle last found the replica complete, 0 if none has.",
+            [&](const Totals&, const CycleStats& s) { return unixSeconds(s.lastSyncedMs.load()); });
+        perPair("syncfolders_replica_staleness_seconds", "gauge", "Seconds since a cycle last found the replica complete, or since the start.",
+            [&](const Totals&, const CycleStats& s) {
+                auto synced = s.lastSyncedMs.load();
+                auto since = synced > 0 ? std::chrono::system_clock::time_point(std::chrono::milliseconds(synced)) : started;
+                return std::chrono::duration<double>(now - since).count();
+            });
+        perPair("syncfolders_walk_queue_directories", "gauge", "Directories queued or being visited by the running walk.",
+            [](const Totals&, const CycleStats& s) { return s.walkQueue.load(); });
+        perPair("syncfolders_watch_pending_paths", "gauge", "Watch mode: changed paths waiting to settle.",
+            [](const Totals&, const CycleStats& s) { return s.watchPending.load(); });
+        header("syncfolders_delete_queue_directories", "gauge", "Directories waiting for the background deletion workers.");
+        for (const auto& pair : pairs) {
+            size_t backlog = 0;
+#ifdef __linux__
+            backlog = pair.deletions != nullptr ? pair.deletions->backlog() : 0;
+#endif
+            out << "syncfolders_delete_queue_directories{pair=\"" << pair.label << "\"} " << backlog << '\n';
+        }
+        header("syncfolders_log_queue_entries", "gauge", "Entries waiting to be written by a log writer.");
+        for (const auto& [label, logger] : logs) {
+            out << "syncfolders_log_queue_entries{log=\"" << label << "\"} " << logger->backlog() << '\n';
+        }
+        return out.str();
+    }
+
+#ifdef __linux__
+    /**
+     * brief Serve GET /metrics over HTTP from a thread of its own
+     * param endpoint [address:]port to listen on; the address defaults to 127.0.0.1
+     * return False if the socket could not be set up
+     */
+    bool listen(const std::string& endpoint) {
+        auto colon = endpoint.rfind(':');
+        std::string address = colon == std::string::npos ? "127.0.0.1" : endpoint.substr(0, colon);
+        sockaddr_in socketAddress{};
+        socketAddress.sin_family = AF_INET;
+        try {
+            int port = std::stoi(endpoint.substr(colon == std::string::npos ? 0 : colon + 1));
+            if (port < 1 || port > 65535) {
+                throw std::out_of_range("port");
+            }
+            socketAddress.sin_port = htons(static_cast<std::uint16_t>(port));
+        }
+        catch (const std::exception&) {
+            logOperation(logFilePath, "Error: Invalid metrics endpoint: " + endpoint);
+            return false;
+        }
+        if (inet_pton(AF_INET, address.c_str(), &socketAddress.sin_addr) != 1) {
+            logOperation(logFilePath, "Error: Invalid metrics address: " + address);
+            return false;
+        }
+
+        listenFd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int reuse = 1;
+        if (listenFd < 0 || setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) != 0
+            || bind(listenFd, reinterpret_cast<sockaddr*>(&socketAddress), sizeof(socketAddress)) != 0 || ::listen(listenFd, 16) != 0
+            || pipe2(pipeFds, O_CLOEXEC) != 0) {
+            logOperation(logFilePath, "Error: Unable to listen for metrics on " + endpoint + ": " + std::strerror(errno));
+            return false;
+        }
+        server = std::thread(&MetricsExporter::serve, this);
+        return true;
+    }
+#endif
+
+private:
+    struct Pair {
+        std::string label;  ///< Escaped for the exposition format
+        const CycleStats* stats;
+        const DeletionEngine* deletions;
+    };
+
+    /**
+     * brief Escape a label value for the exposition format
+     */
+    static std::string escape(const std::string& value) {
+        std::string escaped;
+        for (char c : value) {
+            if (c == '\\' || c == '"') {
+                escaped += '\\';
+                escaped += c;
+            }
+            else if (c == '\n') {
+                escaped += "\\n";
+            }
+            else {
+                escaped += c;
+            }
+        }
+        return escaped;
+    }
+
+#ifdef __linux__
+    struct Connection {
+        FileDescriptor fd;
+        std::chrono::steady_clock::time_point deadline;  ///< Dropped if not done by then
+        std::string request;
+        std::string response;                            ///< Empty until the request head is in
+        size_t written = 0;
+
+        Connection(int fd, std::chrono::steady_clock::time_point deadline) : fd(fd), deadline(deadline) {}
+    };
+
+    static constexpr size_t maxConnections = 64;
+    static constexpr std::chrono::seconds readTimeout{ 1 };   ///< For the request head
+    static constexpr std::chrono::seconds writeTimeout{ 5 };  ///< For the response
+
+    /**
+     * brief Server thread: answer one request per connection until stopped
+     *
+     * Connections are non-blocking and polled together, so an idle or slow client only holds
+     * up itself, and it is dropped once its deadline passes.
+     */
+    void serve() {
+        using Clock = std::chrono::steady_clock;
+        std::list<Connection> connections;
+        std::vector<pollfd> descriptors;
+        while (!stopping) {
+            auto now = Clock::now();
+            connections.remove_if([now](const Connection& connection) { return connection.deadline <= now; });
+            descriptors.clear();
+            descriptors.push_back({ pipeFds[0], POLLIN, 0 });
+            descriptors.push_back({ listenFd, static_cast<short>(connections.size() < maxConnections ? POLLIN : 0), 0 });
+            auto wakeAt = Clock::time_point::max();
+            for (const auto& connection : connections) {
+                descriptors.push_back({ connection.fd.fd, static_cast<short>(connection.response.empty() ? POLLIN : POLLOUT), 0 });
+                wakeAt = std::min(wakeAt, connection.deadline);
+            }
+            int timeout = connections.empty() ? -1
+                : static_cast<int>(std::chrono::ceil<std::chrono::milliseconds>(wakeAt - now).count());
+            if (poll(descriptors.data(), descriptors.size(), timeout) < 0 || descriptors[0].revents != 0) {
+                continue;
+            }
+
+            size_t d = 2;
+            for (auto it = connections.begin(); it != connections.end(); ++d) {
+                bool open = descriptors[d].revents == 0 || advance(*it);
+                it = open ? std::next(it) : connections.erase(it);
+            }
+            if (descriptors[1].revents != 0) {
+                int fd = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK);
+                if (fd >= 0) {
+                    connections.emplace_back(fd, Clock::now() + readTimeout);
+                }
+            }
+        }
+    }
+
+    /**
+     * brief Read from or write to a connection that poll reported ready
+     * return False once the connection is done with or failed
+     */
+    bool advance(Connection& connection) {
+        if (connection.response.empty()) {
+            // Read the whole request head, so that closing the connection does not reset it
+            char buffer[1024];
+            ssize_t bytes = read(connection.fd.fd, buffer, sizeof(buffer));
+            if (bytes < 0 && (errno == EAGAIN || errno == EINTR)) {
+                return true;
+            }
+            if (bytes > 0) {
+                connection.request.append(buffer, static_cast<size_t>(bytes));
+                if (connection.request.find("\r\n\r\n") == std::string::npos && connection.request.size() < 16384) {
+                    return true;
+                }
+            }
+            connection.response = respond(connection.request);
+            connection.deadline = std::chrono::steady_clock::now() + writeTimeout;
+        }
+        ssize_t bytes = send(connection.fd.fd, connection.response.data() + connection.written,
+            connection.response.size() - connection.written, MSG_NOSIGNAL);
+        if (bytes < 0) {
+            return errno == EAGAIN || errno == EINTR;
+        }
+        connection.written += static_cast<size_t>(bytes);
+        return connection.written < connection.response.size();
+    }
+
+    /**
+     * brief Build the HTTP response to a request head
+     */
+    std::string respond(const std::string& request) const {
+        std::string status = "200 OK";
+        std::string body;
+        if (request.rfind("GET ", 0) != 0) {
+            status = "405 Method Not Allowed";
+        }
+        else if (request.compare(4, 9, "/metrics ") != 0 && request.compare(4, 9, "/metrics?") != 0) {
+            status = "404 Not Found";
+        }
+        else {
+            body = render();
+        }
+        return "HTTP/1.1 " + status + "\r\nContent-Type: text/plain; version=0.0.4; charset=utf-8\r\nContent-Length: "
+            + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+    }
+
+    int listenFd = -1;
+    int pipeFds[2] = { -1, -1 };  ///< Wakes the server thread when stopping
+    std::atomic<bool> stopping{ false };
+    std::thread server;
+#endif
+
+    std::string logFilePath;
+    std::chrono::system_clock::time_point started;
+    std::vector<Pair> pairs;
+    std::vector<std::pair<std::string, const AsyncLogger*>> logs;
+    fs::path file;
+    std::mutex fileMutex;
+    bool reportedFileError = false;
+};
+
+/**
+ * brief Close the cycle in progress: add it to the pair's totals and refresh the metrics file
+ * param options Options holding the pair's counters and the exporter, if any
+ */
+void finishCycle(const SyncOptions& options) {
+    options.stats->finish();
+    if (options.metrics != nullptr) {
+        options.metrics->cycleFinished();
+    }
+}
+
+/**
+ * brief Validate if the source path is a valid directory
+ * param source Source directory path
+ * param logFilePath Path to the log file
+ * return True if the source path is valid, false otherwise
+ */
+bool isSourceValid(const fs::path& source, const std::string& logFilePath) {
+    if (!fs::exists(source)) {
+        logOperation(logFilePath, "Error: Source path does not exist.");
+        return false;
+    }
+    if (!fs::is_directory(source)) {
+        logOperation(logFilePath, "Error: Source path is not a directory.");
+        return false;
+    }
+    return true;
+}
+
+/**
+ * brief Record whether the cycle left the replica complete
+ *
+ * Every cycle visits each directory pair and merge-joins both listings, so a walk that
+ * reported no error left the replica equal to the source. Nothing is counted again, which
+ * keeps an idle cycle proportional to what changed rather than to the size of the trees.
+ * param logFilePath Path to the log file
+ * param options Counters of the pair
+ */
+void checkSyncCompletion(const std::string& logFilePath, const SyncOptions& options) {
+    if (options.stats->errors.load() != 0) {
+        return;
+    }
+    options.stats->lastSyncedMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    auto& changesMade = options.stats->changesMade;
+    if (changesMade) {
+        logOperation(logFilePath, "Synchronization complete. All files and directories are synchronized.");
+        changesMade = false;  // Reset changes flag after logging completion
+    }
+}
+
+/**
+ * brief Save the tree snapshots to the state file, if one was requested
+ * param snapshot Tree snapshots, or nullptr
+ * param options Options naming the state file
+ * param source Source root the snapshots belong to
+ * param replica Replica root the snapshots belong to
+ * param logFilePath Path to the log file
+ */
+void saveSnapshot(const PairSnapshot* snapshot, const SyncOptions& options, const fs::path& source, const fs::path& replica,
+    const std::string& logFilePath) {
+    if (snapshot != nullptr && !options.stateFile.empty() && !snapshot->save(options.stateFile, source, replica)) {
+        logOperation(logFilePath, "Error: Unable to write state file: " + options.stateFile.string());
+    }
+}
+
+/**
+ * brief Format the counters of a cycle as key=value pairs
+ * param stats Counters of the cycle
+ * return The counters, separated by spaces
+ */
+std::string formatCycleStats(const CycleStats& stats) {
+    auto milliseconds = [](const ShardedCounter<std::int64_t>& counter) { return counter.load() / 1e6; };
+    std::ostringstream summary;
+    summary << std::fixed << std::setprecision(3);
+    summary << "directories=" << stats.directoriesScanned
+        << " files_scanned=" << stats.filesScanned
+        << " files_hashed=" << stats.filesHashed
+        << " bytes_hashed=" << stats.bytesHashed
+        << " files_copied=" << stats.filesCopied
+        << " bytes_copied=" << stats.bytesCopied
+        << " removed=" << stats.entriesRemoved
+        << " directories_created=" << stats.directoriesCreated
+        << " walk_ms=" << milliseconds(stats.walkNs)
+        << " list_ms=" << milliseconds(stats.listingNs)
+        << " hash_ms=" << milliseconds(stats.hashingNs)
+        << " copy_ms=" << milliseconds(stats.copyingNs)
+        << " remove_ms=" << milliseconds(stats.removingNs)
+        << " check_ms=" << milliseconds(stats.checkNs)
+        << " save_ms=" << milliseconds(stats.saveNs)
+        << " interval_ms=" << stats.intervalMs
+        << " overruns=" << stats.overruns
+        << " missed_ticks=" << stats.missedTicks;
+    return summary.str();
+}
+
+/**
+ * brief One line of the control interface's status reply
+ * param name Label of the pair, empty when there is only one
+ * param state What the pair is doing
+ * param stats Counters of the pair; while a cycle runs they show its progress so far
+ */
+std::string formatStatus(const std::string& name, const std::string& state, const CycleStats& stats) {
+    return (name.empty() ? std::string() : "[" + name + "] ") + "state=" + state + " cycle=" + std::to_string(stats.cycle.load())
+        + " directories=" + std::to_string(stats.directoriesScanned.load()) + " files_scanned=" + std::to_string(stats.filesScanned.load())
+        + " files_copied=" + std::to_string(stats.filesCopied.load()) + " bytes_copied=" + std::to_string(stats.bytesCopied.load())
+        + " removed=" + std::to_string(stats.entriesRemoved.load()) + " interval_ms=" + std::to_string(stats.intervalMs.load());
+}
+
+/**
+ * brief Report the cycle counted in options.stats: a summary line, a cycle event and the report file
+ *
+ * At summary verbosity every cycle gets a summary line; otherwise only cycles that changed the
+ * replica do. The event log and the report file get every cycle reported here.
+ * param logFilePath Path to the log file
+ * param options Verbosity, event log and report file of the run
+ */
+void reportCycle(const std::string& logFilePath, const SyncOptions& options) {
+    const CycleStats& stats = *options.stats;
+    auto nanoseconds = [](const ShardedCounter<std::int64_t>& counter) { return counter.load(); };
+    if (options.verbosity == Verbosity::Summary || stats.changed()) {
+        logOperation(logFilePath, "Cycle summary" + (options.name.empty() ? std::string() : " [" + options.name + "]") + ": "
+            + formatCycleStats(stats));
+    }
+    if (options.events == nullptr && options.reportFile.empty()) {
+        return;
+    }
+
+    auto now = std::chrono::system_clock::now();
+    auto started = std::chrono::duration_cast<std::chrono::milliseconds>(stats.started.time_since_epoch());
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(now - stats.started);
+    JsonObject report;
+    if (!options.name.empty()) {
+        report.field("pair", options.name);
+    }
+    report.field("cycle", stats.cycle.load())
+        .field("start_ms", static_cast<std::int64_t>(started.count()))
+        .field("duration_us", static_cast<std::int64_t>(elapsed.count()))
+        .field("directories", stats.directoriesScanned.load())
+        .field("files_scanned", stats.filesScanned.load())
+        .field("files_hashed", stats.filesHashed.load())
+        .field("bytes_hashed", stats.bytesHashed.load())
+        .field("files_copied", stats.filesCopied.load())
+        .field("bytes_copied", stats.bytesCopied.load())
+        .field("removed", stats.entriesRemoved.load())
+        .field("directories_created", stats.directoriesCreated.load())
+        .field("source_added", stats.sourceAdded.load())
+        .field("source_removed", stats.sourceRemoved.load())
+        .field("walk_us", nanoseconds(stats.walkNs) / 1000)
+        .field("list_us", nanoseconds(stats.listingNs) / 1000)
+        .field("hash_us", nanoseconds(stats.hashingNs) / 1000)
+        .field("copy_us", nanoseconds(stats.copyingNs) / 1000)
+        .field("remove_us", nanoseconds(stats.removingNs) / 1000)
+        .field("check_us", nanoseconds(stats.checkNs) / 1000)
+        .field("save_us", nanoseconds(stats.saveNs) / 1000)
+        .field("interval_ms", stats.intervalMs.load())
+        .field("overruns", stats.overruns.load())
+        .field("missed_ticks", stats.missedTicks.load());
+    std::string text = report.str();
+    if (options.events != nullptr) {
+        // The event carries the report's fields behind its own time and op
+        auto time = std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch());
+        options.events->push({}, "{\"time_ms\":" + std::to_string(time.count()) + ",\"op\":\"cycle\"," + text.substr(1));
+    }
+    if (!options.reportFile.empty()) {
+        // Written aside and renamed, so that readers never see a partial report
+        fs::path temporary = options.reportFile;
+        temporary += ".tmp";
+        std::error_code error;
+        {
+            std::ofstream file(temporary, std::ios::trunc);
+            file << text << '\n';
+            if (!file.good()) {
+                error = std::make_error_code(std::errc::io_error);
+            }
+        }
+        if (!error) {
+            fs::rename(temporary, options.reportFile, error);
+        }
+        if (error) {
+            logOperation(logFilePath, "Error: Unable to write report file: " + options.reportFile.string());
+        }
+    }
+}
+
+/**
+ * brief Run one full cycle: walk both trees, save the snapshots, check completion and log the summary
+ * param source Source directory path
+ * param replica Replica directory path
+ * param logFilePath Path to the log file
+ * param options Walk options
+ * param snapshot Tree snapshots carried across cycles, or nullptr to always read listings
+ */
+void runCycle(const fs::path& source, const fs::path& replica, const std::string& logFilePath, const SyncOptions& options,
+    PairSnapshot* snapshot) {
+    CycleStats& stats = *options.stats;
+    stats.reset();
+    {
+        PhaseTimer timer(stats.walkNs);
+        syncFolders(source, replica, logFilePath, options, snapshot);
+    }
+    {
+        PhaseTimer timer(stats.saveNs);
+        saveSnapshot(snapshot, options, source, replica, logFilePath);
+    }
+    {
+        PhaseTimer timer(stats.checkNs);
+        checkSyncCompletion(logFilePath, options);
+    }
+    finishCycle(options);
+    reportCycle(logFilePath, options);
+}
+
+/**
+ * brief Serves the signals that arrive between and during cycles
+ *
+ * The signal handler only sets a flag and writes a byte to a self-pipe, both async-signal-safe.
+ * A dispatcher thread blocked on the pipe turns that into a condition variable notification,
+ * so the main loop sleeps in waitUntil() and still wakes within milliseconds for a shutdown
+ * (SIGINT, SIGTERM) or a sync request (SIGUSR1). Statistics requests (SIGUSR2) are answered
+ * by the dispatcher thread itself, so they are served in the middle of a long cycle too.
+ * Without a self-pipe the dispatcher checks the flags every 100 ms instead.
+ */
+class SignalDispatcher {
+public:
+    /**
+     * brief Start the dispatcher thread
+     * param logFilePath Path to the log file
+     */
+    explicit SignalDispatcher(const std::string& logFilePath) : logFilePath(logFilePath), started(std::chrono::steady_clock::now()) {
+#ifdef __linux__
+        if (pipe2(pipeFds, O_NONBLOCK | O_CLOEXEC) == 0) {
+            wakeFd = pipeFds[1];
+        }
+        else {
+            pipeFds[0] = pipeFds[1] = -1;
+        }
+#endif
+        dispatcher = std::thread(&SignalDispatcher::dispatch, this);
+    }
+
+    ~SignalDispatcher() {
+        stopping = true;
+        wakeDispatcher();
+        dispatcher.join();
+        // No handler may write to the pipe once it is closed; a late SIGINT or SIGTERM now stops
+        // the process at once, and nobody is left to answer SIGUSR1 or SIGUSR2
+        std::signal(SIGINT, SIG_DFL);
+        std::signal(SIGTERM, SIG_DFL);
+#ifdef SIGUSR1
+        std::signal(SIGUSR1, SIG_IGN);
+        std::signal(SIGUSR2, SIG_IGN);
+#endif
+#ifdef __linux__
+        wakeFd = -1;
+        if (pipeFds[0] >= 0) {
+            close(pipeFds[0]);
+            close(pipeFds[1]);
+        }
+#endif
+    }
+
+    SignalDispatcher(const SignalDispatcher&) = delete;
+    SignalDispatcher& operator=(const SignalDispatcher&) = delete;
+
+    /**
+     * brief Sleep until the deadline, a shutdown or a sync request
+     * param deadline When the next cycle is due
+     * param ready Further condition to wake up for, checked whenever notify() is called
+     */
+    void waitUntil(std::chrono::steady_clock::time_point deadline, const std::function<bool()>& ready = {}) {
+        std::unique_lock<std::mutex> lock(mutex);
+        wake.wait_until(lock, deadline, [&ready] { return !keepRunning || syncRequested || (ready && ready()); });
+    }
+
+    /**
+     * brief Wake waitUntil() to check its condition again
+     */
+    void notify() {
+        std::lock_guard<std::mutex> guard(mutex);
+        wake.notify_all();
+    }
+
+    /**
+     * brief Include a pair in the statistics logged on SIGUSR2
+     * param name Label of the pair, empty when there is only one
+     * param stats Counters of the pair
+     */
+    void addPair(const std::string& name, const CycleStats* stats) {
+        std::lock_guard<std::mutex> guard(mutex);
+        pairs.emplace_back(name, stats);
+    }
+
+    /**
+     * brief Uptime and, for every pair, the counters of the cycle in progress or of the last one
+     * return One line per pair
+     */
+    std::vector<std::string> statistics() {
+        auto uptime = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - started);
+        std::vector<std::string> lines;
+        std::lock_guard<std::mutex> guard(mutex);
+        for (const auto& [name, stats] : pairs) {
+            lines.push_back("Statistics" + (name.empty() ? std::string() : " [" + name + "]") + ": uptime_s="
+                + std::to_string(uptime.count()) + " cycle=" + std::to_string(stats->cycle.load()) + " " + formatCycleStats(*stats));
+        }
+        return lines;
+    }
+
+    /**
+     * brief Take a pending sync request, logging it
+     * return True if a cycle was requested since the last call
+     */
+    bool takeSyncRequest() {
+        if (!syncRequested.exchange(false)) {
+            return false;
+        }
+        logOperation(logFilePath, "Synchronization requested by signal.");
+        return true;
+    }
+
+private:
+    static void wakeDispatcher() {
+#ifdef __linux__
+        char byte = 0;
+        int fd = wakeFd.load();
+        if (fd >= 0) {
+            (void)!write(fd, &byte, 1);
+        }
+#endif
+    }
+
+    /**
+     * brief Dispatcher thread: wait for signals and hand them on
+     */
+    void dispatch() {
+        while (!stopping) {
+#ifdef __linux__
+            if (pipeFds[0] >= 0) {
+                pollfd descriptor{ pipeFds[0], POLLIN, 0 };
+                poll(&descriptor, 1, -1);
+                char buffer[64];
+                while (read(pipeFds[0], buffer, sizeof(buffer)) > 0) {
+                }
+            }
+            else {
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            }
+#else
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+#endif
+            if (statsRequested.exchange(false)) {
+                logStatistics();
+            }
+            // Taking the lock orders the flags set by the handler before the waiter's check
+            std::lock_guard<std::mutex> guard(mutex);
+            wake.notify_all();
+        }
+    }
+
+    /**
+     * brief Log the statistics of every pair
+     */
+    void logStatistics() {
+        for (const auto& line : statistics()) {
+            logOperation(logFilePath, line);
+        }
+    }
+
+    std::string logFilePath;
+    std::chrono::steady_clock::time_point started;
+    std::atomic<bool> stopping{ false };
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::vector<std::pair<std::string, const CycleStats*>> pairs;  ///< Pairs to report statistics for
+    std::thread dispatcher;
+#ifdef __linux__
+    int pipeFds[2] = { -1, -1 };
+#endif
+};
+
+#ifdef __linux__
+/**
+ * brief Split a control request into words
+ */
+std::vector<std::string> splitWords(const std::string& line) {
+    std::vector<std::string> words;
+    std::istringstream stream(line);
+    for (std::string word; stream >> word;) {
+        words.push_back(word);
+    }
+    return words;
+}
+
+/**
+ * brief Local control interface on a Unix domain socket
+ *
+ * Each connection carries one request line, such as "status" or "set interval 30", and gets
+ * a text reply, whose first line starts with "error:" if the request failed. Connections are
+ * accepted and served side by side by a thread of their own. Requests that only read published state, such as
+ * status, are answered right there, so they get a reply in the middle of a long scan too;
+ * the others are answered by the synchronization loop through serve(), so that they never
+ * race with a cycle being scheduled, and the loop is woken through the signal dispatcher when
+ * one arrives. The socket is only accessible to its owner.
+ */
+class ControlServer {
+public:
+    using Handler = std::function<std::string(const std::vector<std::string>&)>;
+
+    ControlServer(const fs::path& path, SignalDispatcher& signals, const std::string& logFilePath)
+        : path(path), signals(signals), logFilePath(logFilePath) {}
+
+    ~ControlServer() {
+        if (server.joinable()) {
+            stopping = true;
+            char byte = 0;
+            (void)!write(pipeFds[1], &byte, 1);
+            server.join();
+        }
+        for (int fd : { listenFd, pipeFds[0], pipeFds[1] }) {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+        if (listenFd >= 0) {
+            unlink(path.c_str());
+        }
+    }
+
+    ControlServer(const ControlServer&) = delete;
+    ControlServer& operator=(const ControlServer&) = delete;
+
+    /**
+     * brief Create the socket and start accepting connections
+     *
+     * A socket left behind by a process that is gone is replaced; one that still answers is not.
+     * return False if the socket could not be set up
+     */
+    bool start() {
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        if (path.native().size() >= sizeof(address.sun_path)) {
+            logOperation(logFilePath, "Error: Control socket path is too long: " + path.string());
+            return false;
+        }
+        std::strcpy(address.sun_path, path.c_str());
+
+        FileDescriptor probe(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+        if (connect(probe.fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0) {
+            logOperation(logFilePath, "Error: Control socket is in use by another process: " + path.string());
+            return false;
+        }
+        struct stat info;
+        if (lstat(path.c_str(), &info) == 0 && S_ISSOCK(info.st_mode)) {
+            unlink(path.c_str());
+        }
+
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0 || bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+            logOperation(logFilePath, "Error: Unable to create control socket " + path.string() + ": " + std::strerror(errno));
+            if (fd >= 0) {
+                close(fd);
+            }
+            return false;
+        }
+        listenFd = fd;
+        if (chmod(path.c_str(), 0600) != 0 || listen(listenFd, 8) != 0 || pipe2(pipeFds, O_CLOEXEC) != 0) {
+            logOperation(logFilePath, "Error: Unable to listen on control socket " + path.string() + ": " + std::strerror(errno));
+            return false;
+        }
+        server = std::thread(&ControlServer::acceptConnections, this);
+        return true;
+    }
+
+    /**
+     * brief Answer some requests on the server thread instead of queueing them for serve()
+     *
+     * The handler runs concurrently with the synchronization, so it may only read state that
+     * is safe to read from another thread.
+     * param handle Returns the reply, or an empty string for requests left to serve(); nullptr queues every request
+     */
+    void answerDirectly(Handler handle) {
+        std::lock_guard<std::mutex> guard(directMutex);
+        direct = std::move(handle);
+    }
+
+    /**
+     * brief Tell whether requests are waiting for serve()
+     */
+    bool pending() {
+        std::lock_guard<std::mutex> guard(mutex);
+        return !requests.empty();
+    }
+
+    /**
+     * brief Answer the waiting requests on the calling thread
+     * param handle Turns the words of a request into its reply
+     */
+    void serve(const Handler& handle) {
+        std::deque<std::shared_ptr<Request>> waiting;
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            waiting.swap(requests);
+        }
+        for (auto& request : waiting) {
+            std::string reply;
+            try {
+                reply = handle(request->words);
+            }
+            catch (const std::exception& e) {
+                reply = "error: " + std::string(e.what()) + "\n";
+            }
+            request->reply.set_value(reply);
+        }
+    }
+
+private:
+    struct Request {
+        std::vector<std::string> words;
+        std::promise<std::string> reply;
+    };
+
+    struct Connection {
+        FileDescriptor fd;
+        std::chrono::steady_clock::time_point deadline;  ///< Dropped, or answered with an error, if not done by then
+        std::string request;
+        std::future<std::string> reply;                  ///< Valid while the request waits for serve()
+        std::string response;                            ///< Empty until the reply is known
+        size_t written = 0;
+
+        Connection(int fd, std::chrono::steady_clock::time_point deadline) : fd(fd), deadline(deadline) {}
+    };
+
+    static constexpr size_t maxRequest = 4096;
+    static constexpr size_t maxConnections = 64;
+    static constexpr std::chrono::seconds readTimeout{ 2 };    ///< For the request line
+    static constexpr std::chrono::seconds replyTimeout{ 10 };  ///< For the synchronization loop to answer
+    static constexpr std::chrono::seconds writeTimeout{ 5 };   ///< For the reply to be taken
+
+    /**
+     * brief Server thread: answer one request per connection until stopped
+     *
+     * Connections are non-blocking and polled together, so a client that is slow to send its
+     * request or to take the reply only holds up itself, and a request waiting for the
+     * synchronization loop does not keep others from being answered.
+     */
+    void acceptConnections() {
+        using Clock = std::chrono::steady_clock;
+        std::list<Connection> connections;
+        std::vector<pollfd> descriptors;
+        while (!stopping) {
+            auto now = Clock::now();
+            for (auto& connection : connections) {
+                if (!connection.reply.valid()) {
+                    continue;
+                }
+                bool answered = connection.reply.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+                if (answered || connection.deadline <= now) {
+                    connection.response = answered ? connection.reply.get() : "error: the synchronization loop did not answer in time; try again\n";
+                    connection.reply = {};
+                    connection.deadline = now + writeTimeout;
+                }
+            }
+            connections.remove_if([now](const Connection& connection) { return connection.deadline <= now; });
+            descriptors.clear();
+            descriptors.push_back({ pipeFds[0], POLLIN, 0 });
+            descriptors.push_back({ listenFd, static_cast<short>(connections.size() < maxConnections ? POLLIN : 0), 0 });
+            auto wakeAt = Clock::time_point::max();
+            for (const auto& connection : connections) {
+                short events = connection.reply.valid() ? 0 : connection.response.empty() ? POLLIN : POLLOUT;
+                descriptors.push_back({ connection.fd.fd, events, 0 });
+                // A reply from the synchronization loop is looked for every 100 ms
+                wakeAt = std::min(wakeAt, connection.reply.valid() ? std::min(connection.deadline, now + std::chrono::milliseconds(100))
+                                                                   : connection.deadline);
+            }
+            int timeout = connections.empty() ? -1
+                : static_cast<int>(std::chrono::ceil<std::chrono::milliseconds>(wakeAt - now).count());
+            if (poll(descriptors.data(), descriptors.size(), timeout) < 0 || descriptors[0].revents != 0) {
+                continue;
+            }
+
+            size_t d = 2;
+            for (auto it = connections.begin(); it != connections.end(); ++d) {
+                bool open = descriptors[d].revents == 0 || advance(*it);
+                it = open ? std::next(it) : connections.erase(it);
+            }
+            if (descriptors[1].revents != 0) {
+                int fd = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK);
+                if (fd >= 0) {
+                    connections.emplace_back(fd, Clock::now() + readTimeout);
+                }
+            }
+        }
+    }
+
+    /**
+     * brief Read from or write to a connection that poll reported ready
+     * return False once the connection is done with or failed
+     */
+    bool advance(Connection& connection) {
+        if (connection.response.empty()) {
+            char buffer[512];
+            ssize_t bytes = read(connection.fd.fd, buffer, sizeof(buffer));
+            if (bytes < 0) {
+                return errno == EAGAIN || errno == EINTR;
+            }
+            if (bytes > 0) {
+                connection.request.append(buffer, static_cast<size_t>(bytes));
+                if (connection.request.find('\n') == std::string::npos && connection.request.size() < maxRequest) {
+                    return true;
+                }
+            }
+            std::vector<std::string> words = splitWords(connection.request.substr(0, connection.request.find('\n')));
+            {
+                std::lock_guard<std::mutex> guard(directMutex);
+                if (direct) {
+                    try {
+                        connection.response = direct(words);
+                    }
+                    catch (const std::exception& e) {
+                        connection.response = "error: " + std::string(e.what()) + "\n";
+                    }
+                }
+            }
+            if (connection.response.empty()) {
+                connection.reply = submit(std::move(words));
+                connection.deadline = std::chrono::steady_clock::now() + replyTimeout;
+                return true;
+            }
+            connection.deadline = std::chrono::steady_clock::now() + writeTimeout;
+        }
+        ssize_t bytes = send(connection.fd.fd, connection.response.data() + connection.written,
+            connection.response.size() - connection.written, MSG_NOSIGNAL);
+        if (bytes < 0) {
+            return errno == EAGAIN || errno == EINTR;
+        }
+        connection.written += static_cast<size_t>(bytes);
+        return connection.written < connection.response.size();
+    }
+
+    /**
+     * brief Queue a request for the synchronization loop
+     * return The reply, once serve() has answered it
+     */
+    std::future<std::string> submit(std::vector<std::string> words) {
+        auto request = std::make_shared<Request>();
+        request->words = std::move(words);
+        auto reply = request->reply.get_future();
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            requests.push_back(request);
+        }
+        signals.notify();
+        return reply;
+    }
+
+    fs::path path;
+    SignalDispatcher& signals;
+    std::string logFilePath;
+    int listenFd = -1;
+    int pipeFds[2] = { -1, -1 };  ///< Wakes the server thread when stopping
+    std::atomic<bool> stopping{ false };
+    std::mutex mutex;
+    std::deque<std::shared_ptr<Request>> requests;  ///< Waiting for serve()
+    std::mutex directMutex;  ///< Held while direct is called or replaced
+    Handler direct;          ///< Answers requests on the server thread, if set
+    std::thread server;
+};
+
+/**
+ * brief Send one request to a running instance and print its reply
+ * param socketPath Control socket of the instance
+ * param words Words of the request
+ * return Exit status: 0 if the request succeeded
+ */
+int runControlClient(const fs::path& socketPath, const std::vector<std::string>& words) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (socketPath.native().size() >= sizeof(address.sun_path)) {
+        std::cerr << "Error: Control socket path is too long: " << socketPath.string() << std::endl;
+        return 1;
+    }
+    std::strcpy(address.sun_path, socketPath.c_str());
+    FileDescriptor connection(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+    if (connection.fd < 0 || connect(connection.fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+        std::cerr << "Error: Unable to connect to " << socketPath.string() << ": " << std::strerror(errno) << std::endl;
+        return 1;
+    }
+
+    std::string request;
+    for (const auto& word : words) {
+        request += (request.empty() ? "" : " ") + word;
+    }
+    request += '\n';
+    if (send(connection.fd, request.data(), request.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(request.size())) {
+        std::cerr << "Error: Unable to send the request: " << std::strerror(errno) << std::endl;
+        return 1;
+    }
+    std::string reply;
+    char buffer[4096];
+    for (ssize_t bytes; (bytes = read(connection.fd, buffer, sizeof(buffer))) > 0;) {
+        reply.append(buffer, static_cast<size_t>(bytes));
+    }
+    std::cout << reply;
+    return reply.rfind("error:", 0) == 0 || reply.empty() ? 1 : 0;
+}
+#endif
+
+/**
+ * brief Schedules cycles on a fixed grid of absolute deadlines, so that the interval does not drift
+ *
+ * Cycle k is due at start + k * interval however long the previous cycles took. A cycle that
+ * finishes after the next one was due is an overrun, handled by the configured policy.
+ *
+ * With an adaptive interval the spacing is recomputed after every cycle, within the configured
+ * bounds: halved when the cycle changed the replica, since more changes are likely to follow,
+ * and stretched by half when it found nothing to do. The interval never drops below four
+ * times the cost of the last cycle, so that scanning takes at most a quarter of the time.
+ */
+class IntervalScheduler {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    /**
+     * brief Create a scheduler whose first cycle is due now
+     * param interval Time between cycles, or the initial one if it is adaptive
+     * param options Overrun policy, adaptive interval bounds and counters of the pair
+     * param logFilePath Path to the log file
+     */
+    IntervalScheduler(Clock::duration interval, const SyncOptions& options, const std::string& logFilePath)
+        : interval(interval), policy(options.overrunPolicy), minInterval(options.minInterval), maxInterval(options.maxInterval),
+          stats(*options.stats), logFilePath(logFilePath), tick(Clock::now()) {
+        if (adaptive()) {
+            this->interval = std::clamp(interval, minInterval, maxInterval);
+        }
+        stats.intervalMs = std::chrono::duration_cast<std::chrono::milliseconds>(this->interval).count();
+    }
+
+    /**
+     * brief Deadline of the next cycle, once the current one has finished
+     *
+     * Reads whether the cycle changed anything, and what it cost, from the pair's counters.
+     * param finished When the current cycle finished
+     * return When the next cycle should start
+     */
+    Clock::time_point next(Clock::time_point finished) {
+        if (adaptive()) {
+            adapt();
+        }
+        Clock::time_point due = tick + interval * backoff;
+        if (finished <= due) {
+            tick = due;
+            backoff = 1;
+            return tick;
+        }
+
+        CycleStats::add<std::uint64_t>(stats.overruns, 1);
+        auto late = std::chrono::duration_cast<std::chrono::milliseconds>(finished - due);
+        // Grid points that passed while the cycle was still running, the due one included
+        std::int64_t passed = interval.count() > 0 ? (finished - due) / interval + 1 : 1;
+        std::string action;
+        switch (policy) {
+        case OverrunPolicy::RunImmediately:
+            // Run now and stay on the grid: the next deadline is the first tick after the latest missed one
+            tick = due + interval * (passed - 1);
+            CycleStats::add<std::uint64_t>(stats.missedTicks, static_cast<std::uint64_t>(passed - 1));
+            action = "running the next cycle now";
+            logOverrun(late, action);
+            return finished;
+        case OverrunPolicy::SkipMissed:
+            tick = due + interval * passed;
+            CycleStats::add<std::uint64_t>(stats.missedTicks, static_cast<std::uint64_t>(passed));
+            action = "skipping " + std::to_string(passed) + " missed cycle(s)";
+            break;
+        case OverrunPolicy::BackOff:
+            backoff = std::min(backoff * 2, maxBackoff);
+            tick = finished + interval * backoff;
+            action = "backing off to " + std::to_string(std::chrono::duration_cast<std::chrono::seconds>(interval * backoff).count())
+                + " seconds between cycles";
+            break;
+        }
+        logOverrun(late, action);
+        return tick;
+    }
+
+    /**
+     * brief Change the interval, moving the next deadline with it
+     *
+     * Only valid between cycles, once next() has returned the deadline being moved.
+     * param newInterval New interval, or the one to adapt from if it is adaptive
+     * return How far the next deadline moved
+     */
+    Clock::duration setInterval(Clock::duration newInterval) {
+        if (adaptive()) {
+            newInterval = std::clamp(newInterval, minInterval, maxInterval);
+        }
+        Clock::duration shift = newInterval - interval * backoff;
+        tick += shift;
+        interval = newInterval;
+        backoff = 1;
+        stats.intervalMs = std::chrono::duration_cast<std::chrono::milliseconds>(interval).count();
+        return shift;
+    }
+
+private:
+    static constexpr int maxBackoff = 8;  ///< Longest back-off, in intervals
+    static constexpr int costFactor = 4;  ///< Adaptive interval: at least this many times the cost of a cycle
+
+    bool adaptive() const {
+        return maxInterval.count() > 0;
+    }
+
+    /**
+     * brief Recompute the adaptive interval from the cycle that just finished
+     */
+    void adapt() {
+        auto cost = std::chrono::nanoseconds(stats.walkNs.load() + stats.checkNs.load() + stats.saveNs.load());
+        Clock::duration adapted = stats.changed() ? interval / 2 : interval + interval / 2;
+        adapted = std::max<Clock::duration>(adapted, std::chrono::duration_cast<Clock::duration>(cost * costFactor));
+        interval = std::clamp(adapted, minInterval, maxInterval);
+        stats.intervalMs = std::chrono::duration_cast<std::chrono::milliseconds>(interval).count();
+    }
+
+    void logOverrun(std::chrono::milliseconds late, const std::string& action) {
+        logOperation(logFilePath, "Cycle overran the interval by " + std::to_string(late.count()) + " ms; " + action);
+    }
+
+    Clock::duration interval;
+    OverrunPolicy policy;
+    Clock::duration minInterval;
+    Clock::duration maxInterval;
+    CycleStats& stats;  ///< Counters of the pair, which overruns and the interval are reported in
+    std::string logFilePath;
+    Clock::time_point tick;  ///< When the current cycle was due
+    int backoff = 1;         ///< Intervals between cycles while backing off
+};
+
+/**
+ * brief One source/replica pair and everything it keeps across cycles
+ */
+struct SyncPair {
+    fs::path source;
+    fs::path replica;
+    int interval = 0;                 ///< Seconds between cycles
+    SyncOptions options;              ///< Options of the pair; options.stats points at stats once started
+    CycleStats stats;
+    PairSnapshot snapshot;
+    std::shared_ptr<Trash> trash;     ///< Shared with the TrashReclaimer, which only holds it weakly
+#ifdef __linux__
+    std::unique_ptr<DeletionEngine> deletions;
+#endif
+    std::unique_ptr<IntervalScheduler> scheduler;
+
+    // Scheduling state, only touched by the thread running runPairs()
+    std::chrono::steady_clock::time_point deadline;  ///< When the next scheduled cycle is due
+    bool pendingRequest = false;      ///< A sync request is waiting for the pair's next cycle
+    bool requestedCycle = false;      ///< The running cycle was requested rather than scheduled
+    bool running = false;             ///< A cycle of the pair is queued or running on the CyclePool
+    bool stopped = false;             ///< The source went away; no more cycles are run
+    bool paused = false;              ///< Paused through the control interface
+    std::chrono::steady_clock::time_point cycleStarted;  ///< When the running cycle started
+    std::vector<std::function<void(SyncPair&)>> reconfigure;  ///< Changes waiting for the running cycle to finish
+    std::atomic<bool> finished{ false };  ///< Set by the pool thread once the cycle is done
+
+    // Copy of the scheduling state for status requests answered on the control server's thread
+    struct Status {
+        std::string state = "idle";
+        std::chrono::steady_clock::time_point cycleStarted;
+        std::chrono::steady_clock::time_point deadline;
+    };
+    mutable std::mutex statusMutex;
+    Status published;                 ///< Guarded by statusMutex
+
+    /**
+     * brief Publish the scheduling state for status requests answered on another thread; runPairs() thread only
+     */
+    void publishStatus() {
+        std::lock_guard<std::mutex> guard(statusMutex);
+        published.state = stopped ? "stopped" : running ? "running" : paused ? "paused" : "idle";
+        published.cycleStarted = cycleStarted;
+        published.deadline = deadline;
+    }
+
+    /**
+     * brief Status line of the pair as last published, safe to call from any thread
+     * param now Current time
+     */
+    std::string status(std::chrono::steady_clock::time_point now) const {
+        auto milliseconds = [](std::chrono::steady_clock::duration duration) {
+            return std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::max(duration, std::chrono::steady_clock::duration::zero())).count());
+        };
+        std::lock_guard<std::mutex> guard(statusMutex);
+        std::string line = formatStatus(options.name, published.state, stats);
+        if (published.state == "running") {
+            line += " elapsed_ms=" + milliseconds(now - published.cycleStarted);
+        }
+        else if (published.state == "idle") {
+            line += " next_in_ms=" + milliseconds(published.deadline - now);
+        }
+        return line;
+    }
+
+    /**
+     * brief Snapshot to walk with, or nullptr when listings are not cached
+     */
+    PairSnapshot* snapshotOrNull() {
+        return options.cacheListings ? &snapshot : nullptr;
+    }
+
+    /**
+     * brief Set up the trash, background deletion, snapshot and schedule of the pair
+     * param logFilePath Path to the log file
+     * param events Writer of the event log, if one is kept
+     * param io Per-device limit on hashing and copying, if any
+     * param metrics Metrics exporter, if any
+     * param walkers Walker threads shared with the other pairs, if any
+     * param reclaimer Thread purging the trashes of every pair
+     */
+    void start(const std::string& logFilePath, AsyncLogger* events, DeviceLimiter* io, MetricsExporter* metrics, WalkerBudget* walkers,
+        TrashReclaimer& reclaimer) {
+        options.stats = &stats;
+        options.events = events;
+        options.io = io;
+        options.metrics = metrics;
+        options.walkers = walkers;
+        if (io != nullptr) {
+            options.sourceDevice = deviceOf(source);
+            options.replicaDevice = deviceOf(replica);
+        }
+
+        // The trash and the staging directory of background deletion are never synchronized
+        if (options.useTrash) {
+            trash = std::make_shared<Trash>(replica, options.trashRetention, logFilePath);
+            reclaimer.add(trash);
+            options.trash = trash.get();
+        }
+        else {
+            std::error_code error;
+            if (fs::is_directory(replica / Trash::trashName, error)) {
+                logOperation(logFilePath, "Note: Keeping the trash of an earlier run, which is only purged with --trash: "
+                    + (replica / Trash::trashName).string());
+            }
+        }
+#ifdef __linux__
+        if (options.deleteThreads > 0) {
+            deletions = std::make_unique<DeletionEngine>(replica, options.deleteThreads, logFilePath, options.verbosity);
+            deletions->start();
+            options.deletions = deletions.get();
+        }
+#endif
+
+        if (options.cacheListings && !options.stateFile.empty()) {
+            size_t loaded = snapshot.load(options.stateFile, source, replica);
+            logOperation(logFilePath, "Loaded tree snapshot with " + std::to_string(loaded) + " entries from " + options.stateFile.string());
+        }
+        scheduler = std::make_unique<IntervalScheduler>(std::chrono::seconds(interval), options, logFilePath);
+        deadline = std::chrono::steady_clock::now();
+    }
+};
+
+/**
+ * brief Read a non-negative count from a control request
+ * param text Word to read
+ * param value Receives the count
+ * return False if the word is not a plain non-negative number
+ */
+bool parseCount(const std::string& text, long& value) {
+    try {
+        size_t end = 0;
+        value = std::stol(text, &end);
+        return end == text.size() && value >= 0;
+    }
+    catch (const std::exception&) {
+        return false;
+    }
+}
+
+/**
+ * brief Read the interval of a pair, in seconds
+ * param text Word to read
+ * param seconds Receives the interval
+ * return False if the word is not a plain number from 1 to what fits an int; like the control
+ *        request, a zero interval is refused, since every cycle would overrun its deadline
+ */
+bool parseInterval(const std::string& text, int& seconds) {
+    long value = 0;
+    if (!parseCount(text, value) || value < 1 || value > std::numeric_limits<int>::max()) {
+        return false;
+    }
+    seconds = static_cast<int>(value);
+    return true;
+}
+
+/**
+ * brief Answer the status and stats control requests on the control server's thread
+ *
+ * Only state that is safe to read from another thread is used: the status each pair last
+ * published and the atomic counters of its cycle in progress, so a reply comes in the middle
+ * of a long cycle too.
+ * param words Words of the request
+ * param pairs Pairs of the loop; the vector itself is not changed while the server runs
+ * param signals Dispatcher reporting the statistics
+ * return The reply, or an empty string for requests left to controlPairs()
+ */
+std::string controlStatus(const std::vector<std::string>& words, const std::vector<std::unique_ptr<SyncPair>>& pairs,
+    SignalDispatcher& signals) {
+    std::string command = words.empty() ? std::string() : words[0];
+    if (command == "stats") {
+        std::string reply;
+        for (const auto& line : signals.statistics()) {
+            reply += line + '\n';
+        }
+        return reply;
+    }
+    if (command != "status") {
+        return {};
+    }
+    std::string target;
+    for (size_t i = 1; i < words.size(); ++i) {
+        target += (target.empty() ? "" : " ") + words[i];
+    }
+    auto now = std::chrono::steady_clock::now();
+    std::string reply;
+    for (const auto& pair : pairs) {
+        if (target.empty() || pair->options.name == target) {
+            reply += pair->status(now) + '\n';
+        }
+    }
+    return reply.empty() ? "error: no pair named " + target + "\n" : reply;
+}
+
+/**
+ * brief Answer a control request in the loop of runPairs()
+ *
+ * Requests naming no pair apply to all of them. Changes to a pair whose cycle is running are
+ * applied once that cycle has finished, so a cycle never sees its options change under it.
+ * param words Words of the request
+ * param pairs Pairs of the loop
+ * param maxConcurrent Most cycles running at once, which the request may change
+ * param io Per-device limiter, which the request may change
+ * param logFilePath Path to the log file
+ * return Reply text
+ */
+std::string controlPairs(const std::vector<std::string>& words, std::vector<std::unique_ptr<SyncPair>>& pairs, unsigned& maxConcurrent,
+    DeviceLimiter* io, const std::string& logFilePath) {
+    std::string command = words.empty() ? std::string() : words[0];
+    bool setting = command == "set";
+
+    // Labels may contain spaces, so the pair is everything after the command and its arguments
+    std::string target;
+    for (size_t i = setting ? 3 : 1; i < words.size(); ++i) {
+        target += (target.empty() ? "" : " ") + words[i];
+    }
+    std::vector<SyncPair*> selected;
+    for (auto& pair : pairs) {
+        if (target.empty() || pair->options.name == target) {
+            selected.push_back(pair.get());
+        }
+    }
+    if (selected.empty()) {
+        return "error: no pair named " + target + "\n";
+    }
+
+    std::string request;
+    for (const auto& word : words) {
+        request += (request.empty() ? "" : " ") + word;
+    }
+    std::vector<std::string> deferred;
+    auto apply = [&deferred](SyncPair* pair, std::function<void(SyncPair&)> change) {
+        if (pair->running) {
+            pair->reconfigure.push_back(std::move(change));
+            deferred.push_back(pair->options.name);
+        }
+        else {
+            change(*pair);
+        }
+    };
+
+    long value = 0;
+    if (command == "sync" || command == "pause" || command == "resume") {
+        for (SyncPair* pair : selected) {
+            if (command == "sync") {
+                pair->pendingRequest = true;
+            }
+            else {
+                pair->paused = command == "pause";
+            }
+        }
+    }
+    else if (setting && words.size() >= 3 && parseCount(words[2], value)) {
+        const std::string& key = words[1];
+        if (key == "interval" && value >= 1) {
+            for (SyncPair* pair : selected) {
+                apply(pair, [value](SyncPair& pair) {
+                    pair.interval = static_cast<int>(value);
+                    pair.deadline += pair.scheduler->setInterval(std::chrono::seconds(value));
+                });
+            }
+        }
+        else if (key == "threads" && value >= 1) {
+            for (SyncPair* pair : selected) {
+                apply(pair, [value](SyncPair& pair) { pair.options.threads = static_cast<unsigned>(value); });
+            }
+        }
+        else if (key == "device-io" && target.empty() && io != nullptr) {
+            io->setLimit(static_cast<unsigned>(value));
+        }
+        else if (key == "max-concurrent-pairs" && target.empty() && value >= 1) {
+            maxConcurrent = static_cast<unsigned>(value);
+        }
+        else {
+            return "error: invalid setting or value: " + request + "\n";
+        }
+    }
+    else {
+        return "error: unknown request; expected status, stats, sync, pause, resume or "
+               "set interval|threads|device-io|max-concurrent-pairs <n> [pair]\n";
+    }
+
+    logOperation(logFilePath, "Control request: " + request);
+    std::string reply = "ok\n";
+    for (const auto& name : deferred) {
+        reply += "applies after the running cycle of " + (name.empty() ? std::string("the pair") : name) + "\n";
+    }
+    return reply;
+}
+
+/**
+ * brief Long-lived threads that run the cycles of every pair
+ *
+ * A thread is added only when a cycle is submitted while every existing one is busy, so the
+ * pool grows to the most cycles that ever ran at once, which runPairs() keeps within its
+ * concurrency limit, and no thread is started or joined per cycle.
+ */
+class CyclePool {
+public:
+    /**
+     * brief Create an empty pool
+     * param run Runs one cycle of a pair; must not throw
+     */
+    explicit CyclePool(std::function<void(SyncPair*)> run) : run(std::move(run)) {}
+
+    ~CyclePool() {
+        stop();
+    }
+
+    CyclePool(const CyclePool&) = delete;
+    CyclePool& operator=(const CyclePool&) = delete;
+
+    /**
+     * brief Run a cycle of a pair on an idle thread, starting one if there is none
+     */
+    void submit(SyncPair* pair) {
+        std::lock_guard<std::mutex> guard(mutex);
+        queue.push_back(pair);
+        if (idle < queue.size()) {
+            threads.emplace_back(&CyclePool::work, this);
+        }
+        wake.notify_one();
+    }
+
+    /**
+     * brief Let the submitted cycles finish and stop every thread
+     */
+    void stop() {
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        threads.clear();
+    }
+
+private:
+    void work() {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            ++idle;
+            wake.wait(lock, [this] { return stopping || !queue.empty(); });
+            --idle;
+            if (queue.empty()) {
+                return;
+            }
+            SyncPair* pair = queue.front();
+            queue.pop_front();
+            lock.unlock();
+            run(pair);
+            lock.lock();
+        }
+    }
+
+    std::function<void(SyncPair*)> run;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<SyncPair*> queue;     ///< Submitted cycles no thread has taken yet
+    size_t idle = 0;                 ///< Threads waiting for a cycle
+    bool stopping = false;
+    std::vector<std::thread> threads;
+};
+
+/**
+ * brief Run the cycles of every pair on one schedule until shutdown
+ *
+ * Due pairs are started earliest deadline first on the threads of a CyclePool, with at
+ * most maxConcurrent cycles running at once and never two of the same pair. How much hashing
+ * and copying those cycles do at once on each device is limited separately, by the options'
+ * DeviceLimiter. A sync request marks every pair; a pair whose source went away is stopped
+ * while the others carry on. Control requests are answered between these steps.
+ * param pairs Started pairs
+ * param maxConcurrent Most cycles running at once
+ * param io Per-device limiter, if any
+ * param control Control interface, if any
+ * param signals Dispatcher of sync requests
+ * param logFilePath Path to the log file
+ * return Exit status: 1 once every pair has stopped
+ */
+int runPairs(std::vector<std::unique_ptr<SyncPair>>& pairs, unsigned maxConcurrent, DeviceLimiter* io, ControlServer* control,
+    SignalDispatcher& signals, const std::string& logFilePath) {
+    using Clock = std::chrono::steady_clock;
+    unsigned running = 0;
+    int status = 0;
+#ifdef __linux__
+    if (control != nullptr) {
+        control->answerDirectly([&pairs, &signals](const std::vector<std::string>& words) { return controlStatus(words, pairs, signals); });
+    }
+#endif
+    auto ready = [&pairs, control] {
+#ifdef __linux__
+        if (control != nullptr && control->pending()) {
+            return true;
+        }
+#endif
+        return std::any_of(pairs.begin(), pairs.end(), [](const auto& pair) { return pair->running && pair->finished; });
+    };
+    CyclePool pool([&signals, &logFilePath](SyncPair* pair) {
+        // An exception escaping a pool thread would terminate every pair, so it ends only this cycle
+        try {
+            runCycle(pair->source, pair->replica, logFilePath, pair->options, pair->snapshotOrNull());
+        }
+        catch (const std::exception& e) {
+            logOperation(logFilePath, "Error: Cycle" + (pair->options.name.empty() ? std::string() : " of pair " + pair->options.name)
+                + " failed: " + e.what());
+            CycleStats::add<std::uint64_t>(pair->options.stats->errors, 1);
+        }
+        pair->finished = true;
+        signals.notify();
+    });
+
+    while (keepRunning) {
+        // Reap finished cycles; a requested cycle leaves the schedule as it was
+        for (auto& pair : pairs) {
+            if (pair->running && pair->finished) {
+                pair->running = false;
+                --running;
+                if (!pair->requestedCycle) {
+                    pair->deadline = pair->scheduler->next(Clock::now());
+                }
+                for (auto& change : pair->reconfigure) {
+                    change(*pair);
+                }
+                pair->reconfigure.clear();
+            }
+        }
+        if (signals.takeSyncRequest()) {
+            for (auto& pair : pairs) {
+                pair->pendingRequest = true;
+            }
+        }
+#ifdef __linux__
+        if (control != nullptr) {
+            control->serve([&](const std::vector<std::string>& words) {
+                return controlPairs(words, pairs, maxConcurrent, io, logFilePath);
+            });
+        }
+#else
+        (void)io;
+#endif
+
+        auto now = Clock::now();
+        std::vector<SyncPair*> due;
+        for (auto& pair : pairs) {
+            if (!pair->running && !pair->stopped && !pair->paused && (pair->pendingRequest || pair->deadline <= now)) {
+                due.push_back(pair.get());
+            }
+        }
+        std::sort(due.begin(), due.end(), [](const SyncPair* a, const SyncPair* b) { return a->deadline < b->deadline; });
+        for (SyncPair* pair : due) {
+            if (running >= maxConcurrent) {
+                break;
+            }
+            if (!isSourceValid(pair->source, logFilePath)) {
+                logOperation(logFilePath, pairs.size() == 1 ? std::string("Source directory has been deleted or is inaccessible. Exiting...")
+                    : "Source directory of pair " + pair->options.name + " has been deleted or is inaccessible; the pair is stopped.");
+                pair->stopped = true;
+                continue;
+            }
+            pair->requestedCycle = pair->pendingRequest && now < pair->deadline;
+            pair->pendingRequest = false;
+            pair->finished = false;
+            pair->running = true;
+            pair->cycleStarted = now;
+            ++running;
+            pool.submit(pair);
+        }
+        if (std::all_of(pairs.begin(), pairs.end(), [](const auto& pair) { return pair->stopped; })) {
+            status = 1;
+            break;
+        }
+
+        // Sleep until an idle pair is due (if it could be started), a cycle finishes, a shutdown
+        // or a sync request
+        Clock::time_point wakeAt = now + std::chrono::hours(1);
+        if (running < maxConcurrent) {
+            for (auto& pair : pairs) {
+                if (!pair->running && !pair->stopped && !pair->paused) {
+                    wakeAt = std::min(wakeAt, pair->deadline);
+                }
+            }
+        }
+        for (auto& pair : pairs) {
+            pair->publishStatus();
+        }
+        signals.waitUntil(wakeAt, ready);
+    }
+
+    // Let the cycles in progress finish
+    pool.stop();
+#ifdef __linux__
+    if (control != nullptr) {
+        control->answerDirectly(nullptr);
+    }
+#endif
+    return status;
+}
+
+#ifdef __linux__
+/**
+ * brief Event-driven synchronization loop used in watch mode
+ *
+ * Paths reported by the watcher are coalesced and synchronized one by one once they have been
+ * quiet for options.quietPeriod, or options.maxStaleness after their first event at the
+ * latest. A full scan runs at startup, every interval, whenever the watcher lost events and
+ * when one is requested with SIGUSR1 or through the control interface, which otherwise only
+ * answers status and statistics requests in this mode.
+ * param source Source directory path
+ * param replica Replica directory path
+ * param interval Seconds between full reconciliation scans
+ * param logFilePath Path to the log file
+ * param options Walk options
+ * param snapshot Tree snapshots carried across cycles, or nullptr to always read listings
+ * param signals Dispatcher of sync requests
+ * param control Control interface, if any
+ * return Exit status
+ */
+int watchFolders(const fs::path& source, const fs::path& replica, int interval, const std::string& logFilePath,
+    const SyncOptions& options, PairSnapshot* snapshot, SignalDispatcher& signals, ControlServer* control) {
+    SourceWatcher watcher(source, options.filter);
+    if (!watcher.start()) {
+        logOperation(logFilePath, "Error: Unable to initialize inotify: " + std::string(std::strerror(errno)));
+        return 1;
+    }
+    logOperation(logFilePath, "Watching source for changes; full scans every " + std::to_string(interval) + " seconds");
+
+    CycleStats& stats = *options.stats;
+    ChangeCoalescer coalescer(options.quietPeriod, options.maxStaleness);
+    IntervalScheduler scheduler(std::chrono::seconds(interval), options, logFilePath);
+    bool fullScan = true;
+    auto nextFullScan = std::chrono::steady_clock::now();
+
+    // Status and stats are answered on the control server's thread, even during a long scan,
+    // from a copy of nextFullScan; the server stops using this frame before the frame is left
+    std::atomic<std::chrono::steady_clock::rep> publishedScan(nextFullScan.time_since_epoch().count());
+    struct DirectAnswers {
+        ControlServer* control;
+        ~DirectAnswers() {
+            if (control != nullptr) {
+                control->answerDirectly(nullptr);
+            }
+        }
+    } directAnswers{ control };
+    if (control != nullptr) {
+        control->answerDirectly([&](const std::vector<std::string>& words) -> std::string {
+            std::string command = words.empty() ? std::string() : words[0];
+            if (command == "status") {
+                auto scanAt = std::chrono::steady_clock::time_point(std::chrono::steady_clock::duration(publishedScan.load()));
+                auto untilScan = std::max(scanAt - std::chrono::steady_clock::now(), std::chrono::steady_clock::duration::zero());
+                return formatStatus(options.name, "watching", stats) + " next_scan_in_ms="
+                    + std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(untilScan).count()) + "\n";
+            }
+            if (command == "stats") {
+                std::string reply;
+                for (const auto& line : signals.statistics()) {
+                    reply += line + '\n';
+                }
+                return reply;
+            }
+            return {};
+        });
+    }
+    while (keepRunning) {
+        if (!isSourceValid(source, logFilePath)) {
+            logOperation(logFilePath, "Source directory has been deleted or is inaccessible. Exiting...");
+            return 1;
+        }
+
+        if (signals.takeSyncRequest()) {
+            fullScan = true;
+        }
+        if (control != nullptr) {
+            control->serve([&](const std::vector<std::string>& words) -> std::string {
+                if (!words.empty() && words[0] == "sync" && words.size() == 1) {
+                    logOperation(logFilePath, "Control request: sync");
+                    fullScan = true;
+                    return "ok\n";
+                }
+                return "error: only status, stats and sync are available in watch mode\n";
+            });
+        }
+        auto now = std::chrono::steady_clock::now();
+        if (fullScan || now >= nextFullScan) {
+            // The scan covers whatever was still waiting to settle; only a scheduled one moves the schedule
+            bool scheduled = now >= nextFullScan;
+            coalescer.clear();
+            stats.watchPending = 0;
+            runCycle(source, replica, logFilePath, options, snapshot);
+            if (scheduled) {
+                nextFullScan = scheduler.next(std::chrono::steady_clock::now());
+                publishedScan = nextFullScan.time_since_epoch().count();
+            }
+            fullScan = false;
+            continue;
+        }
+
+        // Wake up regularly to notice shutdown requests, and in time for the next due path
+        auto timeout = std::min<std::chrono::steady_clock::duration>({ std::chrono::milliseconds(200), nextFullScan - now,
+            std::max(coalescer.nextDeadline(), now) - now });
+        std::vector<ChangedPath> changes;
+        if (!watcher.collect(std::chrono::ceil<std::chrono::milliseconds>(timeout), changes)) {
+            logOperation(logFilePath, "Watch events were lost; running a full scan.");
+            fullScan = true;
+            continue;
+        }
+        now = std::chrono::steady_clock::now();
+        for (const auto& change : changes) {
+            coalescer.add(change, now);
+        }
+        std::vector<ChangedPath> ready = coalescer.takeReady(now);
+        stats.watchPending = static_cast<std::int64_t>(coalescer.size());
+        if (!ready.empty()) {
+            stats.reset();
+            {
+                PhaseTimer timer(stats.walkNs);
+                syncPaths(source, replica, std::move(ready), logFilePath, options, snapshot);
+            }
+            {
+                PhaseTimer timer(stats.saveNs);
+                saveSnapshot(snapshot, options, source, replica, logFilePath);
+            }
+            finishCycle(options);
+            // Batches that found nothing to do are not worth a line, even at summary verbosity
+            if (stats.changed()) {
+                reportCycle(logFilePath, options);
+            }
+        }
+    }
+    return 0;
+}
+#endif
+
+/**
+ * brief Print command line usage
+ * param program Program name (argv[0])
+ */
+void printUsage(const char* program) {
+    std::cerr << "Usage: " << program << " <source_path> <replica_path> <interval_seconds> <log_file_path> [options]" << std::endl
+        << "       " << program << " --config <pairs_file> <log_file_path> [options]" << std::endl
+        << "       " << program << " --control <socket> <request>   (status, stats, sync, pause, resume," << std::endl
+        << "                     set interval|threads|device-io|max-concurrent-pairs <n> [pair])" << std::endl
+        << "Options:" << std::endl
+        << "  --threads <n>      Worker threads for the tree walk (default: CPU count, at most 8)" << std::endl
+        << "  --deterministic    Log in serial walk order even when walking in parallel" << std::endl
+        << "  --state-file <f>   Persist directory listings and stamps in <f> across restarts" << std::endl
+        << "  --no-listing-cache Re-read every directory listing each cycle" << std::endl
+        << "  --watch            Sync changed directories as soon as inotify reports them; the interval" << std::endl
+        << "                     then only schedules full reconciliation scans (Linux only)" << std::endl
+        << "  --quiet-period <ms>  Watch mode: sync a path once it had no events for <ms> (default: 500)" << std::endl
+        << "  --max-staleness <ms> Watch mode: sync a busy path at most <ms> after its first event (default: 10000)" << std::endl
+        << "  --delete-threads <n> Workers removing stale directories in the background; 0 removes them" << std::endl
+        << "                     inline (default: 4, Linux only)" << std::endl
+        << "  --log-flush <ms>   Flush the log at most every <ms>; 0 flushes after every batch (default: 0)" << std::endl
+        << "  --log-milliseconds Add milliseconds to log timestamps" << std::endl
+        << "  --max-interval <s> Adapt the interval between cycles to the changes found, up to <s> seconds" << std::endl
+        << "  --min-interval <s> Shortest adaptive interval (default: 1)" << std::endl
+        << "  --overrun <policy>  When a cycle takes longer than the interval: run the next one now (run)," << std::endl
+        << "                     wait for the next scheduled tick (skip) or double the interval (backoff)" << std::endl
+        << "                     (default: run)" << std::endl
+        << "  --verbosity <level> Log every entry (file), one line per changed directory (directory) or" << std::endl
+        << "                     only the per-cycle summary (summary) (default: file)" << std::endl
+        << "  --log-max-size <MiB> Rotate the log once it reaches <MiB> (default: 0, no size limit)" << std::endl
+        << "  --log-max-age <minutes> Rotate the log once it has been written to for <minutes> (default: 0, no age limit)" << std::endl
+        << "  --log-generations <n> Rotated logs kept (default: 5)" << std::endl
+        << "  --no-log-compress  Keep rotated logs uncompressed; they are gzipped in the background otherwise" << std::endl
+        << "  --event-log <f>    Also write every operation and cycle to <f> as JSON lines" << std::endl
+        << "  --report-file <f>  Rewrite <f> with the statistics of each cycle, as one JSON object" << std::endl
+        << "  --trash            Move removed replica entries into .syncfolders-trash/<cycle> instead of" << std::endl
+        << "                     deleting them" << std::endl
+        << "  --trash-retention <minutes> Purge trash older than this in the background (default: 1440)" << std::endl
+        << "  --exclude <pattern>  Leave entries matching a gitignore-style pattern alone on both sides" << std::endl
+        << "  --include <pattern>  Sync entries matching the pattern even if an earlier rule excluded them" << std::endl
+        << "  --filter-file <f>    Read gitignore-style rules from <f>; rules apply in command line order" << std::endl
+        << "  --name <label>     Label of the pair in logs, events and reports (default with --config: the replica path)" << std::endl
+        << "  --max-concurrent-pairs <n> With --config: most pairs synchronized at once (default: 4)" << std::endl
+        << "  --device-io <n>    Most files hashed or copied at once on each device, across pairs (default: 0, unlimited)" << std::endl
+        << "  --control-socket <path> Answer control requests on a Unix domain socket at <path> (Linux only)" << std::endl
+        << "  --metrics-file <f> Rewrite <f> with Prometheus metrics after every cycle (node_exporter textfile format)" << std::endl
+        << "  --metrics-listen <[address:]port> Serve Prometheus metrics at http://address:port/metrics" << std::endl
+        << "                     (address defaults to 127.0.0.1; Linux only)" << std::endl;
+}
+
+/**
+ * brief Parse the optional arguments that follow the positional ones
+ * param argc Argument count
+ * param argv Argument values
+ * param first Index of the first optional argument
+ * param options Options to fill in
+ * return True if every argument was recognized and valid
+ */
+bool parseOptions(int argc, char* argv[], int first, SyncOptions& options) {
+    for (int i = first; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        try {
+            if (arg == "--threads" && hasValue) {
+                int threads = std::stoi(argv[++i]);
+                if (threads < 1) {
+                    std::cerr << "Error: --threads must be at least 1" << std::endl;
+                    return false;
+                }
+                options.threads = static_cast<unsigned>(threads);
+            }
+            else if (arg == "--deterministic") {
+                options.deterministicOrder = true;
+            }
+            else if (arg == "--state-file" && hasValue) {
+                options.stateFile = argv[++i];
+            }
+            else if (arg == "--no-listing-cache") {
+                options.cacheListings = false;
+            }
+            else if (arg == "--watch") {
+#ifdef __linux__
+                options.watch = true;
+#else
+                std::cerr << "Error: --watch is only supported on Linux" << std::endl;
+                return false;
+#endif
+            }
+            else if ((arg == "--quiet-period" || arg == "--max-staleness") && hasValue) {
+                long milliseconds = std::stol(argv[++i]);
+                if (milliseconds < 0) {
+                    std::cerr << "Error: " << arg << " must not be negative" << std::endl;
+                    return false;
+                }
+                (arg == "--quiet-period" ? options.quietPeriod : options.maxStaleness) = std::chrono::milliseconds(milliseconds);
+            }
+            else if (arg == "--delete-threads" && hasValue) {
+                int threads = std::stoi(argv[++i]);
+                if (threads < 0) {
+                    std::cerr << "Error: --delete-threads must not be negative" << std::endl;
+                    return false;
+                }
+                options.deleteThreads = static_cast<unsigned>(threads);
+            }
+            else if (arg == "--log-flush" && hasValue) {
+                long milliseconds = std::stol(argv[++i]);
+                if (milliseconds < 0) {
+                    std::cerr << "Error: --log-flush must not be negative" << std::endl;
+                    return false;
+                }
+                options.logFlushInterval = std::chrono::milliseconds(milliseconds);
+            }
+            else if (arg == "--log-milliseconds") {
+                options.logMilliseconds = true;
+            }
+            else if (arg == "--log-max-size" && hasValue) {
+                long long megabytes = std::stoll(argv[++i]);
+                if (megabytes < 0) {
+                    std::cerr << "Error: --log-max-size must not be negative" << std::endl;
+                    return false;
+                }
+                options.logRotation.maxSize = static_cast<std::uintmax_t>(megabytes) * 1024 * 1024;
+            }
+            else if (arg == "--log-max-age" && hasValue) {
+                int minutes = std::stoi(argv[++i]);
+                if (minutes < 0) {
+                    std::cerr << "Error: --log-max-age must not be negative" << std::endl;
+                    return false;
+                }
+                options.logRotation.maxAge = std::chrono::minutes(minutes);
+            }
+            else if (arg == "--log-generations" && hasValue) {
+                int generations = std::stoi(argv[++i]);
+                if (generations < 1) {
+                    std::cerr << "Error: --log-generations must be at least 1" << std::endl;
+                    return false;
+                }
+                options.logRotation.generations = static_cast<unsigned>(generations);
+            }
+            else if (arg == "--no-log-compress") {
+                options.logRotation.compress = false;
+            }
+            else if (arg == "--event-log" && hasValue) {
+                options.eventLogFile = argv[++i];
+            }
+            else if (arg == "--report-file" && hasValue) {
+                options.reportFile = argv[++i];
+            }
+            else if (arg == "--min-interval" && hasValue) {
+                int seconds = std::stoi(argv[++i]);
+                if (seconds < 1) {
+                    std::cerr << "Error: --min-interval must be at least 1" << std::endl;
+                    return false;
+                }
+                options.minInterval = std::chrono::seconds(seconds);
+            }
+            else if (arg == "--max-interval" && hasValue) {
+                int seconds = std::stoi(argv[++i]);
+                if (seconds < 1) {
+                    std::cerr << "Error: --max-interval must be at least 1" << std::endl;
+                    return false;
+                }
+                options.maxInterval = std::chrono::seconds(seconds);
+            }
+            else if (arg == "--overrun" && hasValue) {
+                std::string policy = argv[++i];
+                if (policy == "run") {
+                    options.overrunPolicy = OverrunPolicy::RunImmediately;
+                }
+                else if (policy == "skip") {
+                    options.overrunPolicy = OverrunPolicy::SkipMissed;
+                }
+                else if (policy == "backoff") {
+                    options.overrunPolicy = OverrunPolicy::BackOff;
+                }
+                else {
+                    std::cerr << "Error: --overrun must be run, skip or backoff" << std::endl;
+                    return false;
+                }
+            }
+            else if (arg == "--verbosity" && hasValue) {
+                std::string level = argv[++i];
+                if (level == "file") {
+                    options.verbosity = Verbosity::File;
+                }
+                else if (level == "directory") {
+                    options.verbosity = Verbosity::Directory;
+                }
+                else if (level == "summary") {
+                    options.verbosity = Verbosity::Summary;
+                }
+                else {
+                    std::cerr << "Error: --verbosity must be file, directory or summary" << std::endl;
+                    return false;
+                }
+            }
+            else if (arg == "--name" && hasValue) {
+                options.name = argv[++i];
+            }
+            else if ((arg == "--device-io" || arg == "--max-concurrent-pairs") && hasValue) {
+                int count = std::stoi(argv[++i]);
+                if (count < (arg == "--device-io" ? 0 : 1)) {
+                    std::cerr << "Error: " << arg << (arg == "--device-io" ? " must not be negative" : " must be at least 1") << std::endl;
+                    return false;
+                }
+                (arg == "--device-io" ? options.deviceIo : options.maxConcurrentPairs) = static_cast<unsigned>(count);
+            }
+            else if (arg == "--control-socket" && hasValue) {
+#ifdef __linux__
+                options.controlSocket = argv[++i];
+#else
+                std::cerr << "Error: --control-socket is only supported on Linux" << std::endl;
+                return false;
+#endif
+            }
+            else if (arg == "--metrics-file" && hasValue) {
+                options.metricsFile = argv[++i];
+            }
+            else if (arg == "--metrics-listen" && hasValue) {
+#ifdef __linux__
+                options.metricsListen = argv[++i];
+#else
+                std::cerr << "Error: --metrics-listen is only supported on Linux" << std::endl;
+                return false;
+#endif
+            }
+            else if (arg == "--trash") {
+                options.useTrash = true;
+            }
+            else if (arg == "--trash-retention" && hasValue) {
+                int minutes = std::stoi(argv[++i]);
+                if (minutes < 0) {
+                    std::cerr << "Error: --trash-retention must not be negative" << std::endl;
+                    return false;
+                }
+                options.trashRetention = std::chrono::minutes(minutes);
+            }
+            else if ((arg == "--exclude" || arg == "--include") && hasValue) {
+                std::string pattern = argv[++i];
+                if (!options.filter.add(fs::path(arg == "--include" ? "!" + pattern : pattern).native())) {
+                    std::cerr << "Error: Invalid pattern: " << pattern << std::endl;
+                    return false;
+                }
+            }
+            else if (arg == "--filter-file" && hasValue) {
+                if (!options.filter.addFile(argv[++i])) {
+                    std::cerr << "Error: Unable to read filter file or invalid pattern in it: " << argv[i] << std::endl;
+                    return false;
+                }
+            }
+            else {
+                std::cerr << "Error: Unknown or incomplete option: " << arg << std::endl;
+                return false;
+            }
+        }
+        catch (const std::exception&) {
+            std::cerr << "Error: Invalid value for " << arg << std::endl;
+            return false;
+        }
+    }
+    if (options.maxInterval.count() > 0 && options.maxInterval < options.minInterval) {
+        std::cerr << "Error: --max-interval must not be shorter than --min-interval" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * brief Split a config line into whitespace-separated fields; double quotes group a field
+ * param line Line to split
+ * param fields Receives the fields
+ * return False if a quote is left open
+ */
+bool splitConfigLine(const std::string& line, std::vector<std::string>& fields) {
+    std::string field;
+    bool quoted = false;
+    bool inField = false;
+    for (char c : line) {
+        if (c == '"') {
+            quoted = !quoted;
+            inField = true;
+        }
+        else if (!quoted && std::isspace(static_cast<unsigned char>(c))) {
+            if (inField) {
+                fields.push_back(field);
+                field.clear();
+                inField = false;
+            }
+        }
+        else {
+            field += c;
+            inField = true;
+        }
+    }
+    if (inField) {
+        fields.push_back(field);
+    }
+    return !quoted;
+}
+
+/**
+ * brief Read the pairs of a config file
+ *
+ * Every line holds <source> <replica> <interval_seconds>, optionally followed by options for
+ * that pair alone, which come on top of the ones given on the command line. Blank lines and
+ * lines starting with # are skipped. Options that configure the process rather than a pair
+ * (the log, the event log, watch mode and the shared limits) are only accepted on the command
+ * line. Pairs are labelled with their replica path unless --name gives them a label.
+ * param configPath Config file path
+ * param defaults Options given on the command line
+ * param pairs Receives the pairs, not started yet
+ * return True if the file was read and every line was valid
+ */
+bool readPairs(const fs::path& configPath, const SyncOptions& defaults, std::vector<std::unique_ptr<SyncPair>>& pairs) {
+    static const char* const processOptions[] = { "--watch", "--log-flush", "--log-milliseconds", "--log-max-size", "--log-max-age",
+        "--log-generations", "--no-log-compress", "--event-log", "--device-io", "--max-concurrent-pairs", "--control-socket",
+        "--metrics-file", "--metrics-listen" };
+
+    std::ifstream file(configPath);
+    if (!file.is_open()) {
+        std::cerr << "Error: Unable to read config file: " << configPath.string() << std::endl;
+        return false;
+    }
+    std::string line;
+    for (int number = 1; std::getline(file, line); ++number) {
+        std::vector<std::string> fields;
+        auto where = [&] { return configPath.string() + ":" + std::to_string(number) + ": "; };
+        if (!splitConfigLine(line, fields)) {
+            std::cerr << "Error: " << where() << "Unterminated quote" << std::endl;
+            return false;
+        }
+        if (fields.empty() || fields[0][0] == '#') {
+            continue;
+        }
+        if (fields.size() < 3) {
+            std::cerr << "Error: " << where() << "Expected <source> <replica> <interval_seconds> [options]" << std::endl;
+            return false;
+        }
+
+        auto pair = std::make_unique<SyncPair>();
+        pair->source = fields[0];
+        pair->replica = fields[1];
+        if (!parseInterval(fields[2], pair->interval)) {
+            std::cerr << "Error: " << where() << "Invalid interval, must be at least 1: " << fields[2] << std::endl;
+            return false;
+        }
+
+        std::vector<char*> arguments;
+        for (auto& field : fields) {
+            if (std::find(std::begin(processOptions), std::end(processOptions), field) != std::end(processOptions)) {
+                std::cerr << "Error: " << where() << field << " can only be given on the command line" << std::endl;
+                return false;
+            }
+            arguments.push_back(field.data());
+        }
+        pair->options = defaults;
+        if (!parseOptions(static_cast<int>(arguments.size()), arguments.data(), 3, pair->options)) {
+            std::cerr << "Error: " << where() << "Invalid options" << std::endl;
+            return false;
+        }
+        if (pair->options.name.empty()) {
+            pair->options.name = pair->replica.string();
+        }
+        pairs.push_back(std::move(pair));
+    }
+    if (pairs.empty()) {
+        std::cerr << "Error: No pairs in config file: " << configPath.string() << std::endl;
+        return false;
+    }
+
+    // Paths are compared resolved, component by component, so that /a/b lies within /a but /a/bc does not
+    auto resolve = [](const fs::path& path) {
+        std::error_code error;
+        fs::path resolved = fs::weakly_canonical(fs::absolute(path, error), error);
+        return error ? path.lexically_normal() : resolved;
+    };
+    auto within = [](const fs::path& path, const fs::path& ancestor) {
+        auto p = path.begin();
+        for (auto a = ancestor.begin(); a != ancestor.end(); ++a, ++p) {
+            if (a->empty() && std::next(a) == ancestor.end()) {
+                break;  // Trailing separator
+            }
+            if (p == path.end() || *p != *a) {
+                return false;
+            }
+        }
+        return true;
+    };
+    auto overlap = [&within](const fs::path& a, const fs::path& b) { return within(a, b) || within(b, a); };
+    std::vector<fs::path> sources;
+    std::vector<fs::path> replicas;
+    for (const auto& pair : pairs) {
+        sources.push_back(resolve(pair->source));
+        replicas.push_back(resolve(pair->replica));
+    }
+
+    // Pairs writing the same file would overwrite each other's state, and a replica overlapping
+    // another pair's tree would have its entries removed or overwritten by that pair
+    for (size_t i = 0; i < pairs.size(); ++i) {
+        for (size_t j = 0; j < i; ++j) {
+            const auto& a = pairs[i]->options;
+            const auto& b = pairs[j]->options;
+            if ((!a.stateFile.empty() && a.stateFile == b.stateFile) || (!a.reportFile.empty() && a.reportFile == b.reportFile)) {
+                std::cerr << "Error: Pairs " << b.name << " and " << a.name << " share a state or report file" << std::endl;
+                return false;
+            }
+            if (overlap(replicas[i], replicas[j])) {
+                std::cerr << "Error: Pairs " << b.name << " and " << a.name << " have the same or nested replicas" << std::endl;
+                return false;
+            }
+            if (overlap(replicas[i], sources[j]) || overlap(replicas[j], sources[i])) {
+                std::cerr << "Error: Pairs " << b.name << " and " << a.name << " have a replica overlapping the other's source" << std::endl;
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * brief Main function to handle input arguments and initiate synchronization process
+ * param argc Argument count
+ * param argv Argument values
+ * return Exit status
+ */
+int main(int argc, char* argv[]) {
+    if (argc > 1 && std::string(argv[1]) == "--control") {
+#ifdef __linux__
+        if (argc < 4) {
+            printUsage(argv[0]);
+            return 1;
+        }
+        return runControlClient(argv[2], std::vector<std::string>(argv + 3, argv + argc));
+#else
+        std::cerr << "Error: --control is only supported on Linux" << std::endl;
+        return 1;
+#endif
+    }
+
+    bool configMode = argc > 1 && std::string(argv[1]) == "--config";
+    int firstOption = configMode ? 4 : 5;
+    if (argc < firstOption) {
+        printUsage(argv[0]);
+        return 1;
+    }
+    std::string logFilePath = argv[firstOption - 1];
+
+    SyncOptions options;
+    options.threads = std::clamp(std::thread::hardware_concurrency(), 1u, 8u);
+    if (!parseOptions(argc, argv, firstOption, options)) {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    // Declared first so that it is destroyed last, after every thread that logs
+    AsyncLogger logger(logFilePath, options.logFlushInterval, options.logRotation);
+    timestampCache.setMilliseconds(options.logMilliseconds);
+    std::unique_ptr<AsyncLogger> events;
+    if (!options.eventLogFile.empty()) {
+        events = std::make_unique<AsyncLogger>(options.eventLogFile.string(), options.logFlushInterval, options.logRotation, false);
+    }
+    // The control interface may change the limit at runtime, so it needs a limiter to change
+    std::unique_ptr<DeviceLimiter> io;
+    if (options.deviceIo > 0 || !options.controlSocket.empty()) {
+        io = std::make_unique<DeviceLimiter>(options.deviceIo);
+    }
+
+    TrashReclaimer reclaimer;
+
+    // Pairs run deletion threads that log, so they are declared after the loggers and destroyed
+    // before them; the exporter reads their counters, so it comes after them
+    std::vector<std::unique_ptr<SyncPair>> pairs;
+    if (configMode) {
+        if (options.watch) {
+            std::cerr << "Error: --watch cannot be combined with --config" << std::endl;
+            return 1;
+        }
+        if (!readPairs(argv[2], options, pairs)) {
+            return 1;
+        }
+    }
+    else {
+        auto pair = std::make_unique<SyncPair>();
+        pair->source = argv[1];
+        pair->replica = argv[2];
+        if (!parseInterval(argv[3], pair->interval)) {
+            std::cerr << "Error: Invalid interval, must be at least 1: " << argv[3] << std::endl;
+            return 1;
+        }
+        pair->options = options;
+        pairs.push_back(std::move(pair));
+    }
+    // The cycles running at once share as many extra walker threads as the largest --threads asks for
+    std::unique_ptr<WalkerBudget> walkers;
+    if (pairs.size() > 1) {
+        unsigned most = 1;
+        for (const auto& pair : pairs) {
+            most = std::max(most, pair->options.threads);
+        }
+        walkers = std::make_unique<WalkerBudget>(most - 1);
+    }
+    std::unique_ptr<MetricsExporter> metrics;
+    if (!options.metricsFile.empty() || !options.metricsListen.empty()) {
+        metrics = std::make_unique<MetricsExporter>(logFilePath);
+        metrics->setFile(options.metricsFile);
+        metrics->addLog("main", &logger);
+        if (events) {
+            metrics->addLog("events", events.get());
+        }
+    }
+
+    // If a source is invalid, return
+    for (const auto& pair : pairs) {
+        if (!isSourceValid(pair->source, logFilePath)) {
+            return 1;
+        }
+    }
+
+    // The control socket is claimed before any pair is set up, so that a second instance
+    // started by mistake gives up without touching the replicas
+    SignalDispatcher signals(logFilePath);
+    ControlServer* controlServer = nullptr;
+#ifdef __linux__
+    std::unique_ptr<ControlServer> control;
+    if (!options.controlSocket.empty()) {
+        control = std::make_unique<ControlServer>(options.controlSocket, signals, logFilePath);
+        if (!control->start()) {
+            return 1;
+        }
+        controlServer = control.get();
+    }
+#endif
+
+    logOperation(logFilePath, "Starting folder synchronization.");
+    for (auto& pair : pairs) {
+        if (!pair->options.name.empty()) {
+            logOperation(logFilePath, "Pair: " + pair->options.name);
+        }
+        logOperation(logFilePath, "Source path: " + pair->source.string());
+        logOperation(logFilePath, "Replica path: " + pair->replica.string());
+        logOperation(logFilePath, "Synchronization interval: " + std::to_string(pair->interval) + " seconds");
+        logOperation(logFilePath, "Walker threads: " + std::to_string(pair->options.threads));
+        pair->start(logFilePath, events.get(), io.get(), metrics.get(), walkers.get(), reclaimer);
+        if (metrics) {
+            const DeletionEngine* deletions = nullptr;
+#ifdef __linux__
+            deletions = pair->deletions.get();
+#endif
+            metrics->addPair(pair->options.name.empty() ? pair->replica.string() : pair->options.name, &pair->stats, deletions);
+        }
+    }
+#ifdef __linux__
+    if (metrics && !options.metricsListen.empty()) {
+        if (!metrics->listen(options.metricsListen)) {
+            return 1;
+        }
+        logOperation(logFilePath, "Serving metrics on " + options.metricsListen);
+    }
+#endif
+    if (pairs.size() > 1) {
+        logOperation(logFilePath, "Concurrent pairs: " + std::to_string(options.maxConcurrentPairs));
+    }
+    if (options.deviceIo > 0) {
+        logOperation(logFilePath, "Hashing and copying slots per device: " + std::to_string(options.deviceIo));
+    }
+    if (controlServer != nullptr) {
+        logOperation(logFilePath, "Control socket: " + options.controlSocket.string());
+    }
+
+    // Set up signal handling for graceful shutdown, sync requests and statistics
+    for (const auto& pair : pairs) {
+        signals.addPair(pair->options.name, &pair->stats);
+    }
+    std::signal(SIGINT, signalHandler);
+    std::signal(SIGTERM, signalHandler);
+#ifdef SIGUSR1
+    std::signal(SIGUSR1, signalHandler);
+    std::signal(SIGUSR2, signalHandler);
+#endif
+
+    int status = 0;
+#ifdef __linux__
+    if (options.watch) {
+        SyncPair& pair = *pairs.front();
+        status = watchFolders(pair.source, pair.replica, pair.interval, logFilePath, pair.options, pair.snapshotOrNull(), signals,
+            controlServer);
+    }
+    else
+#endif
+    {
+        status = runPairs(pairs, options.maxConcurrentPairs, io.get(), controlServer, signals, logFilePath);
+    }
+
+    if (status == 0) {
+        logOperation(logFilePath, "Synchronization stopped.");
+    }
+    return status;
 }